@@ -12,7 +12,11 @@ int main(int argc, char** argv)
 
 		renderer->init();
 
-		renderer->render();
+		for (unsigned frame = 0; frame < settings->frame_num; ++frame)
+		{
+			renderer->update();
+			renderer->render();
+		}
 
 		renderer->destroy();
 	}
@@ -2,20 +2,31 @@
 
 #include "resource.h"
 
+#include <array>
 #include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <limits>
 #include <memory>
+#include <type_traits>
 
 
 using namespace linalg::aliases;
 
 static constexpr float DEFAULT_DEPTH = std::numeric_limits<float>::max();
+static constexpr unsigned int PRIMITIVE_RESTART_INDEX = std::numeric_limits<unsigned int>::max();
+static constexpr size_t POST_TRANSFORM_CACHE_SIZE = 32;
 
 namespace cg::renderer
 {
-	template<typename VB, typename RT>
+	enum class primitive_topology
+	{
+		triangle_list,
+		triangle_strip,
+		triangle_fan
+	};
+
+	template<typename VB, typename RT, typename DB = float>
 	class rasterizer
 	{
 	public:
@@ -23,7 +34,7 @@ namespace cg::renderer
 		~rasterizer(){};
 		void set_render_target(
 				std::shared_ptr<resource<RT>> in_render_target,
-				std::shared_ptr<resource<float>> in_depth_buffer = nullptr);
+				std::shared_ptr<resource<DB>> in_depth_buffer = nullptr);
 		void clear_render_target(
 				const RT& in_clear_value, const float in_depth = DEFAULT_DEPTH);
 
@@ -31,6 +42,8 @@ namespace cg::renderer
 		void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
 
 		void set_viewport(size_t in_width, size_t in_height);
+		void set_primitive_topology(primitive_topology in_topology);
+		void set_reverse_z(bool in_reverse_z);
 
 		void draw(size_t num_vertexes, size_t vertex_offset);
 
@@ -41,19 +54,37 @@ namespace cg::renderer
 		std::shared_ptr<cg::resource<VB>> vertex_buffer;
 		std::shared_ptr<cg::resource<unsigned int>> index_buffer;
 		std::shared_ptr<cg::resource<RT>> render_target;
-		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<DB>> depth_buffer;
 
 		size_t width = 1920;
 		size_t height = 1080;
 
+		primitive_topology topology = primitive_topology::triangle_list;
+		bool reverse_z = false;
+
+		struct post_transform_entry
+		{
+			unsigned int index;
+			float4 position;
+			VB vertex_data;
+		};
+		std::array<post_transform_entry, POST_TRANSFORM_CACHE_SIZE> post_transform_cache;
+
+		void reset_post_transform_cache();
+		post_transform_entry transform_vertex(unsigned int index);
+		void rasterize_triangle(const post_transform_entry& a, const post_transform_entry& b, const post_transform_entry& c);
+
 		int edge_function(int2 a, int2 b, int2 c);
 		bool depth_test(float z, size_t x, size_t y);
+
+		static DB encode_depth(float z);
+		static float decode_depth(const DB& depth);
 	};
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_render_target(
+	template<typename VB, typename RT, typename DB>
+	inline void rasterizer<VB, RT, DB>::set_render_target(
 			std::shared_ptr<resource<RT>> in_render_target,
-			std::shared_ptr<resource<float>> in_depth_buffer)
+			std::shared_ptr<resource<DB>> in_depth_buffer)
 	{
 		// TODO Lab: 1.02 Implement `set_render_target`, `set_viewport`, `clear_render_target` methods of `cg::renderer::rasterizer` class
 		render_target = std::move(in_render_target); // привязываем цветовой таргет 
@@ -62,51 +93,58 @@ namespace cg::renderer
 
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
+	template<typename VB, typename RT, typename DB>
+	inline void rasterizer<VB, RT, DB>::set_viewport(size_t in_width, size_t in_height)
 	{
 		// TODO Lab: 1.02 Implement `set_render_target`, `set_viewport`, `clear_render_target` methods of `cg::renderer::rasterizer` class
 		width = in_width;
 		height = in_height;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::clear_render_target(
+	template<typename VB, typename RT, typename DB>
+	inline void rasterizer<VB, RT, DB>::set_primitive_topology(primitive_topology in_topology)
+	{
+		topology = in_topology;
+	}
+
+	template<typename VB, typename RT, typename DB>
+	inline void rasterizer<VB, RT, DB>::set_reverse_z(bool in_reverse_z)
+	{
+		reverse_z = in_reverse_z;
+	}
+
+	template<typename VB, typename RT, typename DB>
+	inline void rasterizer<VB, RT, DB>::clear_render_target(
 			const RT& in_clear_value, const float in_depth)
 	{
 		// TODO Lab: 1.02 Implement `set_render_target`, `set_viewport`, `clear_render_target` methods of `cg::renderer::rasterizer` class
 		if (render_target) {
-			const size_t n = render_target->count();
-			for (size_t i = 0; i < n; ++i) {
-				render_target->item(i) = in_clear_value; // заливка цвета 
-			}
+			// Для тайлового ресурса это fast clear: заливка откладывается до первой записи в тайл
+			render_target->clear(in_clear_value);
 		}
 		// TODO Lab: 1.06 Adjust `set_render_target`, and `clear_render_target` methods of `cg::renderer::rasterizer` class to consume a depth buffer
 		if (depth_buffer) {
 			// Инициализируем глубину большим значением (даль) [web:44]
-			const size_t n = depth_buffer->count();
-			for (size_t i = 0; i < n; ++i) {
-				depth_buffer->item(i) = in_depth;
-			}
+			depth_buffer->clear(encode_depth(in_depth));
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_vertex_buffer(
+	template<typename VB, typename RT, typename DB>
+	inline void rasterizer<VB, RT, DB>::set_vertex_buffer(
 			std::shared_ptr<resource<VB>> in_vertex_buffer)
 	{
 		vertex_buffer = in_vertex_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_index_buffer(
+	template<typename VB, typename RT, typename DB>
+	inline void rasterizer<VB, RT, DB>::set_index_buffer(
 			std::shared_ptr<resource<unsigned int>> in_index_buffer)
 	{
 		index_buffer = in_index_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::draw(size_t num_vertexes, size_t vertex_offset)
+	template<typename VB, typename RT, typename DB>
+	inline void rasterizer<VB, RT, DB>::draw(size_t num_vertexes, size_t vertex_offset)
 	{
 		// TODO Lab: 1.04 Implement `cg::world::camera` class
 		// TODO Lab: 1.05 Add `Rasterization` and `Pixel shader` stages to `draw` method of `cg::renderer::rasterizer`
@@ -120,99 +158,173 @@ namespace cg::renderer
 			return; // нечего рисовать [web:57]
 		}
 
-		// Растеризация по треугольникам через индексный буфер [web:57]
-		const size_t index_count = num_vertexes; // по вызову: draw(model->index_buffers[i]->count(), 0)
-		for (size_t i = 0; i + 2 < index_count; i += 3)
+		// Сборка примитивов по индексному буферу с учётом топологии и primitive restart
+		reset_post_transform_cache();
+
+		std::array<post_transform_entry, 2> window;
+		size_t primitive_vertex = 0; // число вершин в текущем list/strip/fan
+		for (size_t i = 0; i < num_vertexes; ++i)
 		{
-			unsigned int ia = index_buffer->item(vertex_offset + i + 0);
-			unsigned int ib = index_buffer->item(vertex_offset + i + 1);
-			unsigned int ic = index_buffer->item(vertex_offset + i + 2);
+			unsigned int index = index_buffer->item(vertex_offset + i);
+			if (index == PRIMITIVE_RESTART_INDEX) {
+				// Начинаем новый strip/fan (для list отбрасываем незаконченный треугольник)
+				primitive_vertex = 0;
+				continue;
+			}
 
-			// Достаём вершины
-			const VB& va = vertex_buffer->item(ia);
-			const VB& vb = vertex_buffer->item(ib);
-			const VB& vc = vertex_buffer->item(ic);
+			post_transform_entry vertex = transform_vertex(index);
+			if (primitive_vertex < 2) {
+				window[primitive_vertex++] = vertex;
+				continue;
+			}
 
+			switch (topology) {
+				case primitive_topology::triangle_list:
+					rasterize_triangle(window[0], window[1], vertex);
+					primitive_vertex = 0;
+					break;
+				case primitive_topology::triangle_strip:
+					// Чётные треугольники (0,1,2), нечётные (1,0,2) — сохраняем порядок обхода
+					if (primitive_vertex % 2 == 0)
+						rasterize_triangle(window[0], window[1], vertex);
+					else
+						rasterize_triangle(window[1], window[0], vertex);
+					window[0] = window[1];
+					window[1] = vertex;
+					++primitive_vertex;
+					break;
+				case primitive_topology::triangle_fan:
+					// Первая вершина веера остаётся в window[0]
+					rasterize_triangle(window[0], window[1], vertex);
+					window[1] = vertex;
+					++primitive_vertex;
+					break;
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename DB>
+	inline void rasterizer<VB, RT, DB>::reset_post_transform_cache()
+	{
+		for (auto& entry: post_transform_cache)
+			entry.index = PRIMITIVE_RESTART_INDEX;
+	}
+
+	template<typename VB, typename RT, typename DB>
+	inline typename rasterizer<VB, RT, DB>::post_transform_entry
+	rasterizer<VB, RT, DB>::transform_vertex(unsigned int index)
+	{
+		// Post-transform cache: вершина, уже обработанная вершинным шейдером, берётся из кэша
+		post_transform_entry& entry = post_transform_cache[index % POST_TRANSFORM_CACHE_SIZE];
+		if (entry.index != index) {
+			const VB& vertex_data = vertex_buffer->item(index);
 			// Вершинный шейдер: позиция в clip-space + передача атрибутов [web:12]
-			auto [pa_clip, va_ps] = vertex_shader(float4{ va.position.x, va.position.y, va.position.z, 1.f }, va);
-			auto [pb_clip, vb_ps] = vertex_shader(float4{ vb.position.x, vb.position.y, vb.position.z, 1.f }, vb);
-			auto [pc_clip, vc_ps] = vertex_shader(float4{ vc.position.x, vc.position.y, vc.position.z, 1.f }, vc);
-
-			// Отсечение по clip-пространству (тривиальное) [web:12]
-			auto inside = [](const float4& p){
-				float w = p.w;
-				return (-w <= p.x && p.x <= w) && (-w <= p.y && p.y <= w) && (-w <= p.z && p.z <= w);
-			};
-			// Мягкое отсечение: отбрасываем только треугольники целиком за камерой (все w <= 0)
-			if (pa_clip.w <= 0.f && pb_clip.w <= 0.f && pc_clip.w <= 0.f) continue;
-			// Деление на w => NDC [-1,1] [web:12]
-			float inv_wa = 1.f / pa_clip.w;
-			float inv_wb = 1.f / pb_clip.w;
-			float inv_wc = 1.f / pc_clip.w;
-
-			float3 pa_ndc{ pa_clip.x * inv_wa, pa_clip.y * inv_wa, pa_clip.z * inv_wa };
-			float3 pb_ndc{ pb_clip.x * inv_wb, pb_clip.y * inv_wb, pb_clip.z * inv_wb };
-			float3 pc_ndc{ pc_clip.x * inv_wc, pc_clip.y * inv_wc, pc_clip.z * inv_wc };
-
-			// Viewport transform в экранные целочисленные координаты пикселя [web:57]
-			auto to_screen = [&](const float3& p){
-				int sx = int((p.x + 1.f) * 0.5f * float(width));
-				int sy = int((1.f - (p.y + 1.f) * 0.5f) * float(height));
-				return int3{ sx, sy, int(std::round(p.z * 2147483647.0f)) };  // z хранить как float ниже; тут int3 только для удобства xy
-			};
-			int3 sa = to_screen(pa_ndc);
-			int3 sb = to_screen(pb_ndc);
-			int3 sc = to_screen(pc_ndc);
-
-			// Ббокс с отсечением границ [web:57]
-			int minx = std::max(0, std::min({ sa.x, sb.x, sc.x }));
-			int maxx = std::min(int(width) - 1, std::max({ sa.x, sb.x, sc.x }));
-			int miny = std::max(0, std::min({ sa.y, sb.y, sc.y }));
-			int maxy = std::min(int(height) - 1, std::max({ sa.y, sb.y, sc.y }));
-
-			if (minx > maxx || miny > maxy) continue;
-
-			// Предвычисление площади и edge-функций [web:57]
-			int2 a2{ sa.x, sa.y }, b2{ sb.x, sb.y }, c2{ sc.x, sc.y };
-			int area2 = edge_function(a2, b2, c2);
-			if (area2 == 0) continue; // вырожденный треугольник
-
-			// Растеризация по пикселям [web:24]
-			for (int y = miny; y <= maxy; ++y) {
-				for (int x = minx; x <= maxx; ++x) {
-					int2 p{ x, y };
-					int w0 = edge_function(b2, c2, p);
-					int w1 = edge_function(c2, a2, p);
-					int w2 = edge_function(a2, b2, p);
-
-					// Точка внутри/на границе (top-left правило можно добавить при необходимости) [web:12]
-					if ((w0 >= 0 && w1 >= 0 && w2 >= 0) || (w0 <= 0 && w1 <= 0 && w2 <= 0)) {
-						// Нормализация барицентриков [web:24]
-						float fw0 = float(w0) / float(area2);
-						float fw1 = float(w1) / float(area2);
-						float fw2 = float(w2) / float(area2);
-						// внутри цикла по пикселям
+			auto [position, vertex_ps] = vertex_shader(
+					float4{ vertex_data.position.x, vertex_data.position.y, vertex_data.position.z, 1.f },
+					vertex_data);
+			entry = post_transform_entry{ index, position, vertex_ps };
+		}
+		return entry;
+	}
+
+	template<typename VB, typename RT, typename DB>
+	inline void rasterizer<VB, RT, DB>::rasterize_triangle(
+			const post_transform_entry& a, const post_transform_entry& b, const post_transform_entry& c)
+	{
+		const float4& pa_clip = a.position;
+		const float4& pb_clip = b.position;
+		const float4& pc_clip = c.position;
+
+		// Отсечение по clip-пространству (тривиальное) [web:12]
+		auto inside = [](const float4& p){
+			float w = p.w;
+			return (-w <= p.x && p.x <= w) && (-w <= p.y && p.y <= w) && (-w <= p.z && p.z <= w);
+		};
+		// Мягкое отсечение: отбрасываем только треугольники целиком за камерой (все w <= 0)
+		if (pa_clip.w <= 0.f && pb_clip.w <= 0.f && pc_clip.w <= 0.f) return;
+		// Деление на w => NDC [-1,1] [web:12]
+		float inv_wa = 1.f / pa_clip.w;
+		float inv_wb = 1.f / pb_clip.w;
+		float inv_wc = 1.f / pc_clip.w;
+
+		float3 pa_ndc{ pa_clip.x * inv_wa, pa_clip.y * inv_wa, pa_clip.z * inv_wa };
+		float3 pb_ndc{ pb_clip.x * inv_wb, pb_clip.y * inv_wb, pb_clip.z * inv_wb };
+		float3 pc_ndc{ pc_clip.x * inv_wc, pc_clip.y * inv_wc, pc_clip.z * inv_wc };
+
+		// Viewport transform в экранные целочисленные координаты пикселя [web:57]
+		auto to_screen = [&](const float3& p){
+			int sx = int((p.x + 1.f) * 0.5f * float(width));
+			int sy = int((1.f - (p.y + 1.f) * 0.5f) * float(height));
+			return int3{ sx, sy, int(std::round(p.z * 2147483647.0f)) };  // z хранить как float ниже; тут int3 только для удобства xy
+		};
+		int3 sa = to_screen(pa_ndc);
+		int3 sb = to_screen(pb_ndc);
+		int3 sc = to_screen(pc_ndc);
+
+		// Ббокс с отсечением границ [web:57]
+		int minx = std::max(0, std::min({ sa.x, sb.x, sc.x }));
+		int maxx = std::min(int(width) - 1, std::max({ sa.x, sb.x, sc.x }));
+		int miny = std::max(0, std::min({ sa.y, sb.y, sc.y }));
+		int maxy = std::min(int(height) - 1, std::max({ sa.y, sb.y, sc.y }));
+
+		if (minx > maxx || miny > maxy) return;
+
+		// Предвычисление площади и edge-функций [web:57]
+		int2 a2{ sa.x, sa.y }, b2{ sb.x, sb.y }, c2{ sc.x, sc.y };
+		int area2 = edge_function(a2, b2, c2);
+		if (area2 == 0) return; // вырожденный треугольник
+
+		// Обход ббокса по тайлам render target'а: записи идут в один блок памяти, а не поперёк строк
+		const int tile = int(render_target->get_tile_size());
+		const int step_x = tile ? tile : maxx - minx + 1;
+		const int step_y = tile ? tile : maxy - miny + 1;
+		const int start_x = tile ? minx - minx % tile : minx;
+		const int start_y = tile ? miny - miny % tile : miny;
+
+		for (int tile_y = start_y; tile_y <= maxy; tile_y += step_y) {
+			for (int tile_x = start_x; tile_x <= maxx; tile_x += step_x) {
+				const int tile_maxx = std::min(maxx, tile_x + step_x - 1);
+				const int tile_maxy = std::min(maxy, tile_y + step_y - 1);
+
+				// Растеризация по пикселям [web:24]
+				for (int y = std::max(miny, tile_y); y <= tile_maxy; ++y) {
+					for (int x = std::max(minx, tile_x); x <= tile_maxx; ++x) {
+						int2 p{ x, y };
+						int w0 = edge_function(b2, c2, p);
+						int w1 = edge_function(c2, a2, p);
+						int w2 = edge_function(a2, b2, p);
+
+						// Точка внутри/на границе (top-left правило можно добавить при необходимости) [web:12]
+						if ((w0 >= 0 && w1 >= 0 && w2 >= 0) || (w0 <= 0 && w1 <= 0 && w2 <= 0)) {
+							// Нормализация барицентриков [web:24]
+							float fw0 = float(w0) / float(area2);
+							float fw1 = float(w1) / float(area2);
+							float fw2 = float(w2) / float(area2);
+							// внутри цикла по пикселям
 	
 
-						// Интерполяция глубины в NDC (линейная по экрану) [web:24]
-						float z = fw0 * pa_ndc.z + fw1 * pb_ndc.z + fw2 * pc_ndc.z;
-						if (!std::isfinite(z)) continue;
-						z = std::min(1.f, std::max(-1.f, z));
-						
-						// Переводим глубину из NDC [-1, 1] в [0, 1]
-						float z01 = 0.5f * (z + 1.f);
-						
-						// Depth test с нормализованной глубиной
-						if (depth_test(z01, size_t(x), size_t(y))) {
-						
-						  // Цветовой градиент по барицентрикам
-						  float3 rgb = float3{ fw0, fw1, fw2 };
-						  cg::color out = cg::color::from_float3(rgb);
-						
-						  // Запись цвета и глубины (по новому)
-						  render_target->item(size_t(x), size_t(y)) = RT::from_float3(out.to_float3());
-						  if (depth_buffer)
-						    depth_buffer->item(size_t(x), size_t(y)) = z01;
+							// Интерполяция глубины в NDC (линейная по экрану) [web:24]
+							float z = fw0 * pa_ndc.z + fw1 * pb_ndc.z + fw2 * pc_ndc.z;
+							if (!std::isfinite(z)) continue;
+							z = std::min(1.f, std::max(-1.f, z));
+					
+							// Переводим глубину из NDC [-1, 1] в [0, 1]; при reverse-Z проекция уже даёт [0, 1] (ближняя плоскость = 1)
+							float z01 = reverse_z ? std::max(0.f, z) : 0.5f * (z + 1.f);
+							// Сравниваем уже квантованное значение, которое и попадёт в буфер
+							DB stored_depth = encode_depth(z01);
+					
+							// Depth test с нормализованной глубиной
+							if (depth_test(decode_depth(stored_depth), size_t(x), size_t(y))) {
+					
+							  // Цветовой градиент по барицентрикам
+							  float3 rgb = float3{ fw0, fw1, fw2 };
+							  cg::color out = cg::color::from_float3(rgb);
+					
+							  // Запись цвета и глубины (по новому)
+							  render_target->item(size_t(x), size_t(y)) = RT::from_float3(out.to_float3());
+							  if (depth_buffer)
+							    depth_buffer->item(size_t(x), size_t(y)) = stored_depth;
+							}
 						}
 					}
 				}
@@ -221,23 +333,42 @@ namespace cg::renderer
 	}
 	
 
-	template<typename VB, typename RT>
+	template<typename VB, typename RT, typename DB>
 	inline int
-	rasterizer<VB, RT>::edge_function(int2 a, int2 b, int2 c)
+	rasterizer<VB, RT, DB>::edge_function(int2 a, int2 b, int2 c)
 	{
 		// TODO Lab: 1.05 Implement `cg::renderer::rasterizer::edge_function` method
 		return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
 		//return 0;
 	}
 
-	template<typename VB, typename RT>
-	inline bool rasterizer<VB, RT>::depth_test(float z, size_t x, size_t y)
+	template<typename VB, typename RT, typename DB>
+	inline bool rasterizer<VB, RT, DB>::depth_test(float z, size_t x, size_t y)
 	{
 		if (!depth_buffer)
 		{
 			return true;
 		}
-		return depth_buffer->item(x, y) > z;
+		const float stored = decode_depth(depth_buffer->item(x, y));
+		return reverse_z ? stored < z : stored > z;
+	}
+
+	template<typename VB, typename RT, typename DB>
+	inline DB rasterizer<VB, RT, DB>::encode_depth(float z)
+	{
+		if constexpr (std::is_same_v<DB, float>)
+			return z;
+		else
+			return DB::from_float(z);
+	}
+
+	template<typename VB, typename RT, typename DB>
+	inline float rasterizer<VB, RT, DB>::decode_depth(const DB& depth)
+	{
+		if constexpr (std::is_same_v<DB, float>)
+			return depth;
+		else
+			return depth.to_float();
 	}
 
 }// namespace cg::renderer
@@ -3,6 +3,9 @@
 #include "utils/resource_utils.h"
 #include "utils/timer.h"
 
+#include <cstring>
+#include <map>
+
 
 void cg::renderer::rasterization_renderer::init()
 {
@@ -10,13 +13,19 @@ void cg::renderer::rasterization_renderer::init()
 	// TODO Lab: 1.03 Adjust `cg::renderer::rasterization_renderer` and `cg::renderer::renderer` classes to consume `cg::world::model`
 	// TODO Lab: 1.04 Setup an instance of camera `cg::world::camera` class in `cg::renderer::renderer` and `cg::renderer::rasterization_renderer` 
 	// TODO Lab: 1.06 Add depth buffer in `cg::renderer::rasterization_renderer`
-	rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>>();
-	rasterizer->set_viewport(settings->width, settings->height); 
+	topology = settings->primitive_topology == "strip" ? primitive_topology::triangle_strip :
+			   (settings->primitive_topology == "fan" ? primitive_topology::triangle_fan : primitive_topology::triangle_list);
 
-	// Создать render target и depth buffer и привязать их к растеризатору 
-	render_target = std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height);
-	depth_buffer = std::make_shared<cg::resource<float>>(settings->width, settings->height);
-	rasterizer->set_render_target(render_target, depth_buffer); 
+	// Создать render target и depth buffer (в тайловой раскладке) и привязать их к растеризатору 
+	for (auto& target: render_targets)
+		target = std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height, settings->render_target_tile_size);
+	render_target = render_targets[0];
+	if (settings->depth_format == "unorm16")
+		create_pass<cg::unorm16_depth>();
+	else if (settings->depth_format == "unorm24")
+		create_pass<cg::unorm24_depth>();
+	else
+		create_pass<float>();
 
 	// Загрузить модель из настроек (дублирует базовый renderer::load_model, но это локально для этого рендера) 
 	model = std::make_shared<cg::world::model>();
@@ -36,43 +45,194 @@ void cg::renderer::rasterization_renderer::init()
 	camera->set_angle_of_view(settings->camera_angle_of_view);
 	camera->set_z_near(settings->camera_z_near);
 	camera->set_z_far(settings->camera_z_far); 
+	camera->set_reverse_z(settings->reverse_z);
+
+	// Ленты и веера собираются один раз из списков треугольников модели
+	vertex_buffers = model->get_vertex_buffers();
+	index_buffers = model->get_index_buffers();
+	if (topology != primitive_topology::triangle_list)
+	{
+		size_t list_index_count = 0;
+		size_t index_count = 0;
+		for (size_t shape = 0; shape < index_buffers.size(); ++shape)
+		{
+			list_index_count += index_buffers[shape]->count();
+			build_primitives(topology, model->get_vertex_buffers()[shape], model->get_index_buffers()[shape], vertex_buffers[shape], index_buffers[shape]);
+			index_count += index_buffers[shape]->count();
+		}
+		std::cout << "Triangle " << settings->primitive_topology << "s: " << index_count << " indices instead of " << list_index_count << "\n";
+	}
 }
+
+template<typename DB>
+void cg::renderer::rasterization_renderer::create_pass()
+{
+	depth_pass<DB> new_pass;
+	new_pass.rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color, DB>>();
+	new_pass.rasterizer->set_viewport(settings->width, settings->height);
+	new_pass.rasterizer->set_reverse_z(settings->reverse_z);
+	new_pass.rasterizer->set_primitive_topology(topology);
+	new_pass.depth_buffer = std::make_shared<cg::resource<DB>>(settings->width, settings->height, settings->render_target_tile_size);
+	new_pass.rasterizer->set_render_target(render_target, new_pass.depth_buffer);
+	pass = new_pass;
+}
+
+void cg::renderer::rasterization_renderer::build_primitives(
+		primitive_topology in_topology,
+		const std::shared_ptr<cg::resource<cg::vertex>>& in_vertex_buffer,
+		const std::shared_ptr<cg::resource<unsigned int>>& in_index_buffer,
+		std::shared_ptr<cg::resource<cg::vertex>>& out_vertex_buffer,
+		std::shared_ptr<cg::resource<unsigned int>>& out_index_buffer)
+{
+	// Модель хранит отдельную вершину на каждый угол треугольника: без склейки соседям нечего делить
+	auto vertex_less = [](const cg::vertex& a, const cg::vertex& b) {
+		return std::memcmp(&a, &b, sizeof(cg::vertex)) < 0;
+	};
+	std::map<cg::vertex, unsigned int, decltype(vertex_less)> welded(vertex_less);
+	std::vector<cg::vertex> vertices;
+	std::vector<std::array<unsigned int, 3>> triangles(in_index_buffer->count() / 3);
+	for (size_t i = 0; i < 3 * triangles.size(); ++i)
+	{
+		const cg::vertex& vertex = in_vertex_buffer->item(in_index_buffer->item(i));
+		auto [entry, inserted] = welded.emplace(vertex, static_cast<unsigned int>(vertices.size()));
+		if (inserted)
+			vertices.push_back(vertex);
+		triangles[i / 3][i % 3] = entry->second;
+	}
+
+	// Окно из двух последних вершин повторяет сборку примитивов в rasterizer::draw: следующий треугольник
+	// должен начинаться с ребра, которое растеризатор возьмёт из окна
+	const bool strip = in_topology == primitive_topology::triangle_strip;
+	auto get_next_edge = [strip](const std::array<unsigned int, 2>& window, size_t primitive_vertex) {
+		return strip && primitive_vertex % 2 ? std::array<unsigned int, 2>{window[1], window[0]} : window;
+	};
+	// Номер вершины треугольника, с которой начинается ребро edge в его обходе, или 3
+	auto find_edge = [](const std::array<unsigned int, 3>& triangle, const std::array<unsigned int, 2>& edge) {
+		size_t k = 0;
+		while (k < 3 && (triangle[k] != edge[0] || triangle[(k + 1) % 3] != edge[1]))
+			++k;
+		return k;
+	};
+
+	// Треугольники по направленным рёбрам обхода: продолжение ищется среди ещё не вошедших в ленту
+	std::map<std::pair<unsigned int, unsigned int>, std::vector<size_t>> edge_triangles;
+	for (size_t t = 0; t < triangles.size(); ++t)
+	{
+		for (size_t k = 0; k < 3; ++k)
+			edge_triangles[{triangles[t][k], triangles[t][(k + 1) % 3]}].push_back(t);
+	}
+	std::vector<uint8_t> used(triangles.size(), 0);
+	auto find_triangle = [&](const std::array<unsigned int, 2>& edge) {
+		auto entry = edge_triangles.find({edge[0], edge[1]});
+		if (entry != edge_triangles.end())
+		{
+			for (size_t t: entry->second)
+			{
+				if (!used[t])
+					return t;
+			}
+		}
+		return triangles.size();
+	};
+
+	std::vector<unsigned int> indices;
+	indices.reserve(3 * triangles.size());
+	for (size_t start = 0; start < triangles.size(); ++start)
+	{
+		if (used[start])
+			continue;
+		used[start] = 1;
+		if (!indices.empty())
+			indices.push_back(PRIMITIVE_RESTART_INDEX);
+		// Поворот первого треугольника выбирается так, чтобы у ленты было продолжение
+		std::array<unsigned int, 3> first = triangles[start];
+		for (size_t rotation = 0; rotation < 3; ++rotation)
+		{
+			const std::array<unsigned int, 3> rotated{triangles[start][rotation], triangles[start][(rotation + 1) % 3], triangles[start][(rotation + 2) % 3]};
+			const std::array<unsigned int, 2> window = strip ? std::array<unsigned int, 2>{rotated[1], rotated[2]} : std::array<unsigned int, 2>{rotated[0], rotated[2]};
+			if (find_triangle(get_next_edge(window, 3)) < triangles.size())
+			{
+				first = rotated;
+				break;
+			}
+		}
+		indices.insert(indices.end(), first.begin(), first.end());
+		std::array<unsigned int, 2> window = strip ? std::array<unsigned int, 2>{first[1], first[2]} : std::array<unsigned int, 2>{first[0], first[2]};
+		for (size_t primitive_vertex = 3;; ++primitive_vertex)
+		{
+			const std::array<unsigned int, 2> edge = get_next_edge(window, primitive_vertex);
+			const size_t t = find_triangle(edge);
+			if (t == triangles.size())
+				break;
+			used[t] = 1;
+			const unsigned int vertex = triangles[t][(find_edge(triangles[t], edge) + 2) % 3];
+			indices.push_back(vertex);
+			if (strip)
+				window[0] = window[1];
+			window[1] = vertex;
+		}
+	}
+
+	out_vertex_buffer = std::make_shared<cg::resource<cg::vertex>>(vertices.size());
+	for (size_t i = 0; i < vertices.size(); ++i)
+		out_vertex_buffer->item(i) = vertices[i];
+	out_index_buffer = std::make_shared<cg::resource<unsigned int>>(indices.size());
+	for (size_t i = 0; i < indices.size(); ++i)
+		out_index_buffer->item(i) = indices[i];
+}
+
 void cg::renderer::rasterization_renderer::render()
 {
 	// TODO Lab: 1.02 Implement image clearing & saving in `cg::renderer::rasterization_renderer` class
 	// TODO Lab: 1.04 Implement `vertex_shader` lambda for the instance of `cg::renderer::rasterizer`
 	// TODO Lab: 1.05 Implement `pixel_shader` lambda for the instance of `cg::renderer::rasterizer`
 	// TODO Lab: 1.03 Adjust `cg::renderer::rasterization_renderer` and `cg::renderer::renderer` classes to consume `cg::world::model`
+	// Берём свободный буфер кадра: ждём, пока закончится сохранение кадра, который в нём лежал
+	const size_t buffer_id = get_frame_buffer_id();
+	wait_for_frame_buffer(buffer_id);
+	render_target = render_targets[buffer_id];
+
 	float4x4 matrix = mul(
 		camera->get_projection_matrix(),
 		camera->get_view_matrix(),
 		model->get_world_matrix()
 	);
 
-	// Привязать лямбды шейдеров 
-	rasterizer->vertex_shader = [matrix](float4 vertex, cg::vertex vertex_data) {
-		float4 clip = mul(matrix, vertex); // позиция в clip‑пространстве 
-		return std::make_pair(clip, vertex_data); // пробрасываем атрибуты без изменений
-	};
+	// Формат глубины известен только во время выполнения: кадр рисуется выбранным растеризатором
+	std::visit([&](auto& active_pass) {
+		active_pass.rasterizer->set_render_target(render_target, active_pass.depth_buffer);
 
-	rasterizer->pixel_shader = [](const cg::vertex&, const float) -> cg::color {
-	return cg::color::from_float3(float3{1.f, 1.f, 1.f});
-	};
+		// Привязать лямбды шейдеров 
+		active_pass.rasterizer->vertex_shader = [matrix](float4 vertex, cg::vertex vertex_data) {
+			float4 clip = mul(matrix, vertex); // позиция в clip‑пространстве 
+			return std::make_pair(clip, vertex_data); // пробрасываем атрибуты без изменений
+		};
 
-	// Очистка цветового и глубинного буфера 
-	rasterizer->clear_render_target(cg::unsigned_color{0, 255, 0}, 1.0f);
-	// Отрисовка по всем shape модели: задаем VB/IB и вызываем draw 
-	for (size_t shape = 0; shape < model->get_index_buffers().size(); ++shape)
-	{
-		rasterizer->set_vertex_buffer(model->get_vertex_buffers()[shape]); 
-		rasterizer->set_index_buffer(model->get_index_buffers()[shape]);   
-		rasterizer->draw(model->get_index_buffers()[shape]->count(), 0);   
-	}
+		active_pass.rasterizer->pixel_shader = [](const cg::vertex&, const float) -> cg::color {
+		return cg::color::from_float3(float3{1.f, 1.f, 1.f});
+		};
+
+		// Очистка цветового и глубинного буфера 
+		active_pass.rasterizer->clear_render_target(cg::unsigned_color{0, 255, 0}, settings->reverse_z ? 0.f : 1.0f);
+		// Отрисовка по всем shape модели: задаем VB/IB и вызываем draw 
+		for (size_t shape = 0; shape < index_buffers.size(); ++shape)
+		{
+			active_pass.rasterizer->set_vertex_buffer(vertex_buffers[shape]);
+			active_pass.rasterizer->set_index_buffer(index_buffers[shape]);
+			active_pass.rasterizer->draw(index_buffers[shape]->count(), 0);
+		}
+	}, pass);
 
-	// Сохранить результат в файл из настроек 
-	cg::utils::save_resource(*render_target, settings->result_path);
+	// Сохранить результат в файл из настроек (асинхронно, следующий кадр рисуется в другой буфер)
+	save_frame(render_target, buffer_id);
 }
 
-void cg::renderer::rasterization_renderer::destroy() {}
+void cg::renderer::rasterization_renderer::destroy()
+{
+	wait_for_frame_saves();
+}
 
-void cg::renderer::rasterization_renderer::update() {}
+void cg::renderer::rasterization_renderer::update()
+{
+	update_camera_path();
+}
@@ -2,6 +2,8 @@
 #include "renderer/renderer.h"
 #include "resource.h"
 
+#include <variant>
+
 
 namespace cg::renderer
 {
@@ -15,9 +17,36 @@ namespace cg::renderer
 		virtual void render();
 
 	protected:
+		// Растеризатор вместе с буфером глубины своего формата
+		template<typename DB>
+		struct depth_pass
+		{
+			std::shared_ptr<cg::resource<DB>> depth_buffer;
+			std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color, DB>> rasterizer;
+		};
+
+		// Двойная буферизация: в один render target рисуем, другой в это время сохраняется
+		std::array<std::shared_ptr<cg::resource<cg::unsigned_color>>, FRAME_BUFFER_NUM> render_targets;
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
-		std::shared_ptr<cg::resource<float>> depth_buffer;
 
-		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+		// Формат глубины задаётся настройкой depth_format: float, unorm24 или unorm16
+		std::variant<depth_pass<float>, depth_pass<cg::unorm24_depth>, depth_pass<cg::unorm16_depth>> pass;
+
+		// Буферы шейпов в выбранной топологии; для списка треугольников — буферы модели
+		primitive_topology topology = primitive_topology::triangle_list;
+		std::vector<std::shared_ptr<cg::resource<cg::vertex>>> vertex_buffers;
+		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
+
+		template<typename DB>
+		void create_pass();
+
+		// Склеивает одинаковые вершины и жадно собирает соседние треугольники в ленты или веера,
+		// разделённые PRIMITIVE_RESTART_INDEX. Обход каждого треугольника сохраняется
+		static void build_primitives(
+				primitive_topology in_topology,
+				const std::shared_ptr<cg::resource<cg::vertex>>& in_vertex_buffer,
+				const std::shared_ptr<cg::resource<unsigned int>>& in_index_buffer,
+				std::shared_ptr<cg::resource<cg::vertex>>& out_vertex_buffer,
+				std::shared_ptr<cg::resource<unsigned int>>& out_index_buffer);
 	};
 }// namespace cg::renderer
\ No newline at end of file
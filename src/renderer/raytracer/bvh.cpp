@@ -0,0 +1,1407 @@
+#include "bvh.h"
+
+#include "utils/error_handler.h"
+#include "utils/mapped_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <omp.h>
+#include <random>
+
+
+using namespace cg::renderer;
+
+void cg::renderer::aabb::add_point(const float3& point)
+{
+	aabb_min = min(aabb_min, point);
+	aabb_max = max(aabb_max, point);
+}
+
+void cg::renderer::aabb::add_aabb(const aabb& other)
+{
+	aabb_min = min(aabb_min, other.aabb_min);
+	aabb_max = max(aabb_max, other.aabb_max);
+}
+
+void cg::renderer::aabb::intersect_aabb(const aabb& other)
+{
+	aabb_min = max(aabb_min, other.aabb_min);
+	aabb_max = min(aabb_max, other.aabb_max);
+}
+
+float3 cg::renderer::aabb::get_center() const
+{
+	return (aabb_min + aabb_max) * 0.5f;
+}
+
+float cg::renderer::aabb::get_area() const
+{
+	if (is_empty())
+		return 0.f;
+	const float3 extent = aabb_max - aabb_min;
+	return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+bool cg::renderer::aabb::is_empty() const
+{
+	return aabb_min.x > aabb_max.x || aabb_min.y > aabb_max.y || aabb_min.z > aabb_max.z;
+}
+
+bool cg::renderer::aabb::aabb_test(const float3& position, const float3& inv_direction, float max_t, float& t_near) const
+{
+	// Slab test
+	const float3 t0 = (aabb_min - position) * inv_direction;
+	const float3 t1 = (aabb_max - position) * inv_direction;
+	const float3 t_min = min(t0, t1);
+	const float3 t_max = max(t0, t1);
+	t_near = std::max(std::max(t_min.x, t_min.y), std::max(t_min.z, 0.f));
+	const float t_far = BVH_ROBUST_FAR_SCALE * std::min(std::min(t_max.x, t_max.y), std::min(t_max.z, max_t));
+	return t_near <= t_far;
+}
+
+void cg::renderer::bvh::set_builder(bvh_builder in_builder, bool in_optimize_treelets)
+{
+	builder = in_builder;
+	optimize_treelets = in_optimize_treelets;
+}
+
+bvh_builder cg::renderer::bvh::get_builder() const
+{
+	return builder;
+}
+
+void cg::renderer::bvh::set_split_budget(float in_split_budget)
+{
+	if (in_split_budget < 0.f)
+		THROW_ERROR("BVH split budget should not be negative");
+	split_budget = in_split_budget;
+}
+
+void cg::renderer::bvh::set_width(size_t in_width)
+{
+	if (in_width != 2 && in_width != BVH_WIDE_WIDTH)
+		THROW_ERROR("Unsupported BVH width: " + std::to_string(in_width));
+	width = in_width;
+}
+
+void cg::renderer::bvh::set_rebuild_threshold(float in_rebuild_threshold)
+{
+	if (in_rebuild_threshold < 1.f)
+		THROW_ERROR("BVH rebuild threshold should be at least 1");
+	rebuild_threshold = in_rebuild_threshold;
+}
+
+void cg::renderer::bvh::copy_settings(const bvh& other)
+{
+	builder = other.builder;
+	optimize_treelets = other.optimize_treelets;
+	width = other.width;
+	rebuild_threshold = other.rebuild_threshold;
+	split_budget = other.split_budget;
+}
+
+void cg::renderer::bvh::build(const std::vector<aabb>& primitive_bounds, const std::vector<float3>& primitive_vertices)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	nodes.clear();
+	wide_nodes.clear();
+	wide_child_nodes.clear();
+	node_parents.clear();
+	build_nodes.clear();
+	primitive_indices.resize(primitive_bounds.size());
+	for (unsigned int i = 0; i < primitive_indices.size(); ++i)
+		primitive_indices[i] = i;
+
+	statistics = bvh_statistics{};
+	statistics.primitive_count = primitive_bounds.size();
+	if (primitive_bounds.empty())
+		return;
+
+	const bool spatial_splits = builder == bvh_builder::sbvh && !primitive_vertices.empty();
+	if (spatial_splits && primitive_vertices.size() != 3 * primitive_bounds.size())
+		THROW_ERROR("SBVH needs three vertices per primitive");
+	// Ссылок не больше, чем примитивов вместе с бюджетом на дубликаты
+	const size_t max_references = primitive_bounds.size() + (spatial_splits ? static_cast<size_t>(split_budget * static_cast<float>(primitive_bounds.size())) : 0);
+
+	std::vector<float3> centroids(primitive_bounds.size());
+#pragma omp parallel for
+	for (int i = 0; i < static_cast<int>(primitive_bounds.size()); ++i)
+		centroids[i] = primitive_bounds[i].get_center();
+
+	// Двоичное дерево из N листьев содержит не более 2N - 1 узлов;
+	// место под узлы выделено заранее, и задачи берут себе пары узлов через атомарный счётчик
+	build_nodes.resize(2 * max_references - 1);
+	build_nodes[0] = bvh_build_node{aabb{}, 0, static_cast<unsigned int>(primitive_bounds.size())};
+	std::atomic<unsigned int> node_counter{1};
+
+	if (builder == bvh_builder::lbvh)
+	{
+		build_lbvh(primitive_bounds, centroids, node_counter);
+	}
+	else if (spatial_splits)
+	{
+		std::vector<bvh_reference> references(primitive_bounds.size());
+		for (unsigned int i = 0; i < references.size(); ++i)
+		{
+			references[i] = bvh_reference{primitive_bounds[i], i};
+			build_nodes[0].bounds.add_aabb(primitive_bounds[i]);
+		}
+		sbvh_build_context context{primitive_vertices, build_nodes[0].bounds.get_area()};
+		context.split_budget = static_cast<long long>(max_references - primitive_bounds.size());
+		// Листья раскладывают ссылки в primitive_indices сами, по мере готовности
+		primitive_indices.resize(max_references);
+#pragma omp parallel
+#pragma omp single
+		subdivide_spatial(0, std::move(references), 1, node_counter, context);
+		primitive_indices.resize(context.reference_counter);
+	}
+	else
+	{
+		for (const auto& bounds: primitive_bounds)
+			build_nodes[0].bounds.add_aabb(bounds);
+#pragma omp parallel
+#pragma omp single
+		subdivide(0, primitive_bounds, centroids, 1, node_counter);
+	}
+
+	build_nodes.resize(node_counter);
+
+	if (optimize_treelets)
+	{
+		std::vector<float> subtree_costs(build_nodes.size());
+		std::vector<size_t> subtree_heights(build_nodes.size());
+#pragma omp parallel
+#pragma omp single
+		optimize_treelet(0, 1, subtree_costs, subtree_heights);
+	}
+
+	flatten();
+	if (width == BVH_WIDE_WIDTH)
+		build_wide();
+
+	std::chrono::duration<float, std::milli> duration = std::chrono::high_resolution_clock::now() - start;
+	collect_statistics();
+	statistics.build_time = duration.count();
+	statistics.build_sah_cost = statistics.sah_cost;
+	statistics.reference_count = primitive_indices.size();
+	statistics.spatial_splits = spatial_splits;
+}
+
+void cg::renderer::bvh::refit(const std::vector<aabb>& primitive_bounds)
+{
+	if (primitive_bounds.size() != statistics.primitive_count)
+		THROW_ERROR("BVH refit needs the same " + std::to_string(statistics.primitive_count) + " primitives as the build");
+	if (nodes.empty())
+		return;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// Ссылки SBVH при этом получают полные ббоксы примитивов, без обрезки плоскостями разбиения.
+	// Каждый лист пересчитывается своим потоком и поднимается к корню. В родителе поток, пришедший первым,
+	// останавливается, а второй видит готовые ббоксы обоих детей и объединяет их
+	std::vector<std::atomic<unsigned char>> arrivals(nodes.size());
+#pragma omp parallel for schedule(dynamic, 256)
+	for (int i = 0; i < static_cast<int>(nodes.size()); ++i)
+	{
+		bvh_node& leaf = nodes[i];
+		if (!leaf.is_leaf())
+			continue;
+		leaf.bounds = aabb{};
+		for (unsigned int j = 0; j < leaf.primitive_count; ++j)
+			leaf.bounds.add_aabb(primitive_bounds[primitive_indices[leaf.right_first + j]]);
+
+		unsigned int node_index = static_cast<unsigned int>(i);
+		while (node_index != 0)
+		{
+			const unsigned int parent = node_parents[node_index];
+			if (arrivals[parent].fetch_add(1, std::memory_order_acq_rel) == 0)
+				break;
+			nodes[parent].bounds = nodes[parent + 1].bounds;
+			nodes[parent].bounds.add_aabb(nodes[nodes[parent].right_first].bounds);
+			node_index = parent;
+		}
+	}
+
+	// Широкие узлы ссылаются на те же узлы двоичного дерева, достаточно скопировать их ббоксы
+#pragma omp parallel for
+	for (int i = 0; i < static_cast<int>(wide_nodes.size()); ++i)
+	{
+		for (size_t child = 0; child < wide_nodes[i].child_count; ++child)
+			set_wide_child_bounds(static_cast<unsigned int>(i), child, nodes[wide_child_nodes[i][child]].bounds);
+	}
+
+	std::chrono::duration<float, std::milli> duration = std::chrono::high_resolution_clock::now() - start;
+	statistics.sah_cost = compute_sah_cost();
+	statistics.refit_count++;
+	statistics.refit_time = duration.count();
+}
+
+bool cg::renderer::bvh::needs_rebuild() const
+{
+	return statistics.sah_cost > statistics.build_sah_cost * rebuild_threshold;
+}
+
+namespace
+{
+	constexpr char BVH_CACHE_MAGIC[8] = "CGBVH";
+
+	// Заголовок файла кэша; за ним подряд лежат nodes, primitive_indices, wide_nodes и wide_child_nodes
+	struct bvh_cache_header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t key;
+		uint64_t primitive_count;
+		uint64_t reference_count;
+		uint64_t node_count;
+		uint64_t wide_node_count;
+		bvh_statistics statistics;
+	};
+}// namespace
+
+bool cg::renderer::bvh::save(const std::filesystem::path& path, uint64_t key) const
+{
+	if (nodes.empty())
+		return false;
+
+	bvh_cache_header header{};
+	std::copy(std::begin(BVH_CACHE_MAGIC), std::end(BVH_CACHE_MAGIC), header.magic);
+	header.version = BVH_CACHE_VERSION;
+	header.key = get_cache_key(key);
+	header.primitive_count = statistics.primitive_count;
+	header.reference_count = primitive_indices.size();
+	header.node_count = nodes.size();
+	header.wide_node_count = wide_nodes.size();
+	// Сохраняется дерево в том виде, в каком его построил build, а не подогнанное refit
+	header.statistics = statistics;
+	header.statistics.sah_cost = statistics.build_sah_cost;
+	header.statistics.refit_count = 0;
+	header.statistics.refit_time = 0.f;
+
+	// Файл пишется под уникальным временным именем и переименовывается: параллельные запуски
+	// не пишут в один и тот же файл и не видят его недописанным
+	std::random_device random;
+	std::filesystem::path temporary_path = path;
+	temporary_path += ".tmp" + std::to_string((static_cast<uint64_t>(random()) << 32) | random());
+	std::error_code error;
+	{
+		std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+		auto write = [&file](const void* data, size_t size) {
+			file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+		};
+		write(&header, sizeof(header));
+		write(nodes.data(), nodes.size() * sizeof(bvh_node));
+		write(primitive_indices.data(), primitive_indices.size() * sizeof(unsigned int));
+		write(wide_nodes.data(), wide_nodes.size() * sizeof(wide_bvh_node));
+		write(wide_child_nodes.data(), wide_child_nodes.size() * sizeof(wide_child_nodes[0]));
+		if (!file)
+		{
+			file.close();
+			std::filesystem::remove(temporary_path, error);
+			return false;
+		}
+	}
+	std::filesystem::rename(temporary_path, path, error);
+	if (error)
+	{
+		std::error_code remove_error;
+		std::filesystem::remove(temporary_path, remove_error);
+		return false;
+	}
+	return true;
+}
+
+bool cg::renderer::bvh::load(const std::filesystem::path& path, uint64_t key, size_t primitive_count)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	const cg::utils::mapped_file file(path);
+	bvh_cache_header header;
+	if (file.get_size() < sizeof(header))
+		return false;
+	std::memcpy(&header, file.get_data(), sizeof(header));
+	if (!std::equal(std::begin(BVH_CACHE_MAGIC), std::end(BVH_CACHE_MAGIC), header.magic) ||
+		header.version != BVH_CACHE_VERSION || header.key != get_cache_key(key) ||
+		header.primitive_count != primitive_count || header.node_count == 0)
+		return false;
+
+	// Счётчики из файла сравниваются с оставшимся размером до умножения, чтобы произведение не переполнилось
+	size_t remaining_size = file.get_size() - sizeof(header);
+	auto take = [&remaining_size](uint64_t count, size_t element_size, size_t& size) {
+		if (count > remaining_size / element_size)
+			return false;
+		size = static_cast<size_t>(count) * element_size;
+		remaining_size -= size;
+		return true;
+	};
+	size_t nodes_size = 0;
+	size_t primitive_indices_size = 0;
+	size_t wide_nodes_size = 0;
+	size_t wide_child_nodes_size = 0;
+	if (!take(header.node_count, sizeof(bvh_node), nodes_size) ||
+		!take(header.reference_count, sizeof(unsigned int), primitive_indices_size) ||
+		!take(header.wide_node_count, sizeof(wide_bvh_node), wide_nodes_size) ||
+		!take(header.wide_node_count, sizeof(wide_child_nodes[0]), wide_child_nodes_size) ||
+		remaining_size != 0 || (width == BVH_WIDE_WIDTH) != (header.wide_node_count > 0))
+		return false;
+
+	// Массивы копируются прямо из отображённых страниц, без разбора
+	const unsigned char* data = file.get_data() + sizeof(header);
+	nodes.resize(header.node_count);
+	std::memcpy(nodes.data(), data, nodes_size);
+	data += nodes_size;
+	primitive_indices.resize(header.reference_count);
+	std::memcpy(primitive_indices.data(), data, primitive_indices_size);
+	data += primitive_indices_size;
+	wide_nodes.resize(header.wide_node_count);
+	std::memcpy(wide_nodes.data(), data, wide_nodes_size);
+	data += wide_nodes_size;
+	wide_child_nodes.resize(header.wide_node_count);
+	std::memcpy(wide_child_nodes.data(), data, wide_child_nodes_size);
+	// Повреждённый файл не должен уводить обход за границы массивов; при ошибке build всё перестроит
+	if (!validate(primitive_count))
+		return false;
+	build_nodes.clear();
+	link_parents();
+
+	std::chrono::duration<float, std::milli> duration = std::chrono::high_resolution_clock::now() - start;
+	statistics = header.statistics;
+	statistics.build_time = duration.count();
+	statistics.loaded_from_cache = true;
+	return true;
+}
+
+bool cg::renderer::bvh::validate(size_t primitive_count) const
+{
+	auto valid_leaf = [this](uint64_t first, uint64_t count) {
+		return first + count <= primitive_indices.size();
+	};
+	// Дети всегда правее родителя, поэтому циклов нет, а глубину можно посчитать одним проходом.
+	// Глубже BVH_STACK_SIZE строители не спускаются, иначе переполнится стек обхода
+	std::vector<size_t> depths(nodes.size(), 0);
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		const bvh_node& node = nodes[i];
+		if (node.is_leaf())
+		{
+			if (!valid_leaf(node.right_first, node.primitive_count))
+				return false;
+			continue;
+		}
+		if (depths[i] >= BVH_STACK_SIZE || i + 1 >= nodes.size() || node.right_first <= i + 1 || node.right_first >= nodes.size())
+			return false;
+		depths[i + 1] = std::max(depths[i + 1], depths[i] + 1);
+		depths[node.right_first] = std::max(depths[node.right_first], depths[i] + 1);
+	}
+	depths.assign(wide_nodes.size(), 0);
+	for (size_t i = 0; i < wide_nodes.size(); ++i)
+	{
+		const wide_bvh_node& node = wide_nodes[i];
+		if (depths[i] >= BVH_STACK_SIZE || node.child_count == 0 || node.child_count > BVH_WIDE_WIDTH)
+			return false;
+		for (size_t child = 0; child < node.child_count; ++child)
+		{
+			const unsigned int index = node.children[child];
+			if (wide_child_nodes[i][child] >= nodes.size())
+				return false;
+			if (node.primitive_counts[child] > 0)
+			{
+				if (!valid_leaf(index, node.primitive_counts[child]))
+					return false;
+				continue;
+			}
+			if (index <= i || index >= wide_nodes.size())
+				return false;
+			depths[index] = std::max(depths[index], depths[i] + 1);
+		}
+	}
+	return std::all_of(primitive_indices.begin(), primitive_indices.end(), [primitive_count](unsigned int index) {
+		return index < primitive_count;
+	});
+}
+
+uint64_t cg::renderer::bvh::get_cache_key(uint64_t key) const
+{
+	// Всё, от чего зависит дерево, кроме самих примитивов
+	const uint64_t parameters[] = {
+			BVH_CACHE_VERSION, static_cast<uint64_t>(builder), optimize_treelets, width,
+			BVH_BIN_NUM, BVH_MAX_LEAF_SIZE, BVH_TREELET_SIZE, BVH_WIDE_WIDTH,
+			static_cast<uint64_t>(BVH_TRAVERSAL_COST * 1024.f), static_cast<uint64_t>(BVH_INTERSECTION_COST * 1024.f),
+			builder == bvh_builder::sbvh ? static_cast<uint64_t>(split_budget * 1024.f) : 0, BVH_SPATIAL_BIN_NUM};
+	for (uint64_t parameter: parameters)
+	{
+		key ^= parameter + 0x9e3779b97f4a7c15ull + (key << 6) + (key >> 2);
+		key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+		key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+		key ^= key >> 31;
+	}
+	return key;
+}
+
+aabb cg::renderer::bvh::compute_centroid_bounds(unsigned int first, unsigned int count, const std::vector<float3>& centroids) const
+{
+	aabb centroid_bounds;
+	if (count < BVH_PARALLEL_BINNING_THRESHOLD)
+	{
+		for (unsigned int i = first; i < first + count; ++i)
+			centroid_bounds.add_point(centroids[primitive_indices[i]]);
+		return centroid_bounds;
+	}
+
+	// Для больших узлов считаем по кускам в отдельных задачах; объединение ббоксов не зависит от порядка
+	const size_t chunk_num = static_cast<size_t>(omp_get_max_threads());
+	std::vector<aabb> chunk_bounds(chunk_num);
+	for (size_t chunk = 0; chunk < chunk_num; ++chunk)
+	{
+#pragma omp task default(none) firstprivate(chunk, chunk_num, first, count) shared(chunk_bounds, centroids)
+		{
+			const unsigned int begin = first + static_cast<unsigned int>(count * chunk / chunk_num);
+			const unsigned int end = first + static_cast<unsigned int>(count * (chunk + 1) / chunk_num);
+			for (unsigned int i = begin; i < end; ++i)
+				chunk_bounds[chunk].add_point(centroids[primitive_indices[i]]);
+		}
+	}
+#pragma omp taskwait
+
+	for (const auto& bounds: chunk_bounds)
+		centroid_bounds.add_aabb(bounds);
+	return centroid_bounds;
+}
+
+bvh_bins cg::renderer::bvh::bin_primitives(unsigned int first, unsigned int count, const aabb& centroid_bounds, const std::vector<aabb>& primitive_bounds, const std::vector<float3>& centroids) const
+{
+	auto bin_range = [&](bvh_bins& bins, unsigned int begin, unsigned int end) {
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			if (centroid_bounds.aabb_max[axis] - centroid_bounds.aabb_min[axis] <= 0.f)
+				continue;
+			for (unsigned int i = begin; i < end; ++i)
+			{
+				const unsigned int primitive = primitive_indices[i];
+				bvh_bin& bin = bins[axis][get_bin_index(centroids[primitive], centroid_bounds, axis)];
+				bin.bounds.add_aabb(primitive_bounds[primitive]);
+				bin.count++;
+			}
+		}
+	};
+
+	if (count < BVH_PARALLEL_BINNING_THRESHOLD)
+	{
+		bvh_bins bins;
+		bin_range(bins, first, first + count);
+		return bins;
+	}
+
+	// Каждая задача заполняет свои корзины, потом они сливаются
+	const size_t chunk_num = static_cast<size_t>(omp_get_max_threads());
+	std::vector<bvh_bins> chunk_bins(chunk_num);
+	for (size_t chunk = 0; chunk < chunk_num; ++chunk)
+	{
+#pragma omp task default(none) firstprivate(chunk, chunk_num, first, count) shared(chunk_bins, bin_range)
+		bin_range(chunk_bins[chunk],
+				  first + static_cast<unsigned int>(count * chunk / chunk_num),
+				  first + static_cast<unsigned int>(count * (chunk + 1) / chunk_num));
+	}
+#pragma omp taskwait
+
+	bvh_bins bins = chunk_bins[0];
+	for (size_t chunk = 1; chunk < chunk_num; ++chunk)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			for (size_t i = 0; i < BVH_BIN_NUM; ++i)
+			{
+				bins[axis][i].bounds.add_aabb(chunk_bins[chunk][axis][i].bounds);
+				bins[axis][i].count += chunk_bins[chunk][axis][i].count;
+			}
+		}
+	}
+	return bins;
+}
+
+size_t cg::renderer::bvh::get_bin_index(const float3& centroid, const aabb& centroid_bounds, int axis)
+{
+	const float axis_min = centroid_bounds.aabb_min[axis];
+	const float scale = static_cast<float>(BVH_BIN_NUM) / (centroid_bounds.aabb_max[axis] - axis_min);
+	return std::min(BVH_BIN_NUM - 1, static_cast<size_t>((centroid[axis] - axis_min) * scale));
+}
+
+void cg::renderer::bvh::subdivide(unsigned int node_index, const std::vector<aabb>& primitive_bounds, const std::vector<float3>& centroids, size_t depth, std::atomic<unsigned int>& node_counter)
+{
+	const unsigned int first = build_nodes[node_index].left_first;
+	const unsigned int count = build_nodes[node_index].primitive_count;
+	if (count <= 1 || depth >= BVH_STACK_SIZE)
+		return;
+
+	// Разбиение считается по ббоксу центроидов, а не по ббоксу узла
+	const aabb centroid_bounds = compute_centroid_bounds(first, count, centroids);
+	const bvh_bins bins = bin_primitives(first, count, centroid_bounds, primitive_bounds, centroids);
+
+	float best_cost = std::numeric_limits<float>::max();
+	int best_axis = -1;
+	size_t best_split = 0;
+	aabb best_left_bounds, best_right_bounds;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		if (centroid_bounds.aabb_max[axis] - centroid_bounds.aabb_min[axis] <= 0.f)
+			continue;
+
+		// Площади и количества слева и справа от каждой из BVH_BIN_NUM - 1 плоскостей
+		std::array<aabb, BVH_BIN_NUM - 1> left_bounds, right_bounds;
+		std::array<unsigned int, BVH_BIN_NUM - 1> left_count, right_count;
+		aabb left_sweep, right_sweep;
+		unsigned int left_sum = 0, right_sum = 0;
+		for (size_t i = 0; i < BVH_BIN_NUM - 1; ++i)
+		{
+			left_sum += bins[axis][i].count;
+			left_count[i] = left_sum;
+			left_sweep.add_aabb(bins[axis][i].bounds);
+			left_bounds[i] = left_sweep;
+
+			right_sum += bins[axis][BVH_BIN_NUM - 1 - i].count;
+			right_count[BVH_BIN_NUM - 2 - i] = right_sum;
+			right_sweep.add_aabb(bins[axis][BVH_BIN_NUM - 1 - i].bounds);
+			right_bounds[BVH_BIN_NUM - 2 - i] = right_sweep;
+		}
+
+		for (size_t i = 0; i < BVH_BIN_NUM - 1; ++i)
+		{
+			if (left_count[i] == 0 || right_count[i] == 0)
+				continue;
+			const float cost = left_count[i] * left_bounds[i].get_area() + right_count[i] * right_bounds[i].get_area();
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = i;
+				best_left_bounds = left_bounds[i];
+				best_right_bounds = right_bounds[i];
+			}
+		}
+	}
+
+	// Все центроиды совпали: делить нечем
+	if (best_axis < 0)
+		return;
+
+	const float node_area = build_nodes[node_index].bounds.get_area();
+	const float split_cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * best_cost / node_area;
+	const float leaf_cost = BVH_INTERSECTION_COST * static_cast<float>(count);
+	if (split_cost >= leaf_cost && count <= BVH_MAX_LEAF_SIZE)
+		return;
+
+	auto middle = std::partition(
+			primitive_indices.begin() + first, primitive_indices.begin() + first + count,
+			[&](unsigned int primitive) {
+				return get_bin_index(centroids[primitive], centroid_bounds, best_axis) <= best_split;
+			});
+	const unsigned int left_count = static_cast<unsigned int>(middle - primitive_indices.begin()) - first;
+
+	// Ббоксы детей уже посчитаны при проходе по корзинам
+	const unsigned int left_child = node_counter.fetch_add(2);
+	build_nodes[left_child] = bvh_build_node{best_left_bounds, first, left_count};
+	build_nodes[left_child + 1] = bvh_build_node{best_right_bounds, first + left_count, count - left_count};
+
+	build_nodes[node_index].left_first = left_child;
+	build_nodes[node_index].primitive_count = 0;
+
+	// Крупные поддеревья строятся параллельными задачами, мелкие — сразу, без накладных расходов на задачу
+	if (count >= BVH_PARALLEL_TASK_THRESHOLD)
+	{
+#pragma omp task default(none) firstprivate(left_child, depth) shared(primitive_bounds, centroids, node_counter)
+		subdivide(left_child, primitive_bounds, centroids, depth + 1, node_counter);
+	}
+	else
+	{
+		subdivide(left_child, primitive_bounds, centroids, depth + 1, node_counter);
+	}
+	subdivide(left_child + 1, primitive_bounds, centroids, depth + 1, node_counter);
+}
+
+namespace
+{
+	struct bvh_spatial_bin
+	{
+		aabb bounds;
+		// Сколько ссылок начинается и заканчивается в корзине
+		unsigned int entries = 0;
+		unsigned int exits = 0;
+	};
+
+	struct bvh_split
+	{
+		float cost = std::numeric_limits<float>::max();
+		int axis = -1;
+		// Плоскость лежит между корзинами plane и plane + 1
+		size_t plane = 0;
+		aabb left_bounds;
+		aabb right_bounds;
+		unsigned int left_count = 0;
+		unsigned int right_count = 0;
+	};
+
+	// Плоскость между корзинами с наименьшей SAH-стоимостью. left_count(bin) и right_count(bin) — сколько ссылок
+	// корзины достаётся левому и правому ребёнку: для объектных корзин это одно число, для пространственных — входы и выходы
+	template<typename B, size_t N, typename L, typename R>
+	void find_best_plane(int axis, const std::array<B, N>& bins, L&& left_count, R&& right_count, bvh_split& best)
+	{
+		std::array<aabb, N - 1> left_bounds, right_bounds;
+		std::array<unsigned int, N - 1> left_counts, right_counts;
+		aabb left_sweep, right_sweep;
+		unsigned int left_sum = 0, right_sum = 0;
+		for (size_t i = 0; i < N - 1; ++i)
+		{
+			left_sum += left_count(bins[i]);
+			left_counts[i] = left_sum;
+			left_sweep.add_aabb(bins[i].bounds);
+			left_bounds[i] = left_sweep;
+
+			right_sum += right_count(bins[N - 1 - i]);
+			right_counts[N - 2 - i] = right_sum;
+			right_sweep.add_aabb(bins[N - 1 - i].bounds);
+			right_bounds[N - 2 - i] = right_sweep;
+		}
+
+		for (size_t i = 0; i < N - 1; ++i)
+		{
+			if (left_counts[i] == 0 || right_counts[i] == 0)
+				continue;
+			const float cost = left_counts[i] * left_bounds[i].get_area() + right_counts[i] * right_bounds[i].get_area();
+			if (cost < best.cost)
+				best = bvh_split{cost, axis, i, left_bounds[i], right_bounds[i], left_counts[i], right_counts[i]};
+		}
+	}
+}// namespace
+
+void cg::renderer::bvh::subdivide_spatial(unsigned int node_index, std::vector<bvh_reference> references, size_t depth, std::atomic<unsigned int>& node_counter, sbvh_build_context& context)
+{
+	const unsigned int count = static_cast<unsigned int>(references.size());
+	const aabb node_bounds = build_nodes[node_index].bounds;
+	auto make_leaf = [&]() {
+		const unsigned int first = context.reference_counter.fetch_add(count);
+		for (unsigned int i = 0; i < count; ++i)
+			primitive_indices[first + i] = references[i].primitive;
+		build_nodes[node_index] = bvh_build_node{node_bounds, first, count};
+	};
+	if (count <= 1 || depth >= BVH_STACK_SIZE)
+		return make_leaf();
+
+	// Объектное разбиение — как в subdivide, только по ббоксам ссылок, а не примитивов
+	aabb centroid_bounds;
+	for (const auto& reference: references)
+		centroid_bounds.add_point(reference.bounds.get_center());
+	auto get_count = [](const bvh_bin& bin) { return bin.count; };
+	bvh_split object_split;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		if (centroid_bounds.aabb_max[axis] - centroid_bounds.aabb_min[axis] <= 0.f)
+			continue;
+		std::array<bvh_bin, BVH_BIN_NUM> bins;
+		for (const auto& reference: references)
+		{
+			bvh_bin& bin = bins[get_bin_index(reference.bounds.get_center(), centroid_bounds, axis)];
+			bin.bounds.add_aabb(reference.bounds);
+			bin.count++;
+		}
+		find_best_plane(axis, bins, get_count, get_count, object_split);
+	}
+
+	// Пространственное разбиение режет ссылки плоскостями по ббоксу узла. Пробуем его, только когда
+	// дети объектного разбиения заметно перекрываются и бюджет на дубликаты ещё не исчерпан
+	aabb overlap = object_split.left_bounds;
+	overlap.intersect_aabb(object_split.right_bounds);
+	bvh_split spatial_split;
+	std::array<float, 3> bin_sizes{};
+	if (count > BVH_SPATIAL_SPLIT_MIN_REFERENCES && context.split_budget.load(std::memory_order_relaxed) > 0 &&
+		(object_split.axis < 0 || overlap.get_area() > BVH_SPATIAL_SPLIT_ALPHA * context.root_area))
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const float axis_min = node_bounds.aabb_min[axis];
+			bin_sizes[axis] = (node_bounds.aabb_max[axis] - axis_min) / static_cast<float>(BVH_SPATIAL_BIN_NUM);
+			if (bin_sizes[axis] <= 0.f)
+				continue;
+			auto get_spatial_bin = [&](float position) {
+				const float bin = std::max((position - axis_min) / bin_sizes[axis], 0.f);
+				return std::min(BVH_SPATIAL_BIN_NUM - 1, static_cast<size_t>(bin));
+			};
+
+			// Ссылка режется по границам всех корзин, через которые проходит, и каждая корзина получает свой кусок
+			std::array<bvh_spatial_bin, BVH_SPATIAL_BIN_NUM> bins;
+			for (const auto& reference: references)
+			{
+				const size_t first_bin = get_spatial_bin(reference.bounds.aabb_min[axis]);
+				const size_t last_bin = get_spatial_bin(reference.bounds.aabb_max[axis]);
+				bins[first_bin].entries++;
+				bins[last_bin].exits++;
+				bvh_reference rest = reference;
+				for (size_t bin = first_bin; bin < last_bin; ++bin)
+				{
+					bvh_reference left, right;
+					split_reference(rest, context.primitive_vertices, axis, axis_min + bin_sizes[axis] * static_cast<float>(bin + 1), left, right);
+					bins[bin].bounds.add_aabb(left.bounds);
+					rest = right;
+				}
+				bins[last_bin].bounds.add_aabb(rest.bounds);
+			}
+			find_best_plane(
+					axis, bins, [](const bvh_spatial_bin& bin) { return bin.entries; },
+					[](const bvh_spatial_bin& bin) { return bin.exits; }, spatial_split);
+		}
+	}
+
+	const bool use_spatial_split = spatial_split.cost < object_split.cost;
+	const bvh_split& best_split = use_spatial_split ? spatial_split : object_split;
+	if (best_split.axis < 0)
+		return make_leaf();
+
+	const float node_area = node_bounds.get_area();
+	const float split_cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * best_split.cost / node_area;
+	const float leaf_cost = BVH_INTERSECTION_COST * static_cast<float>(count);
+	if (split_cost >= leaf_cost && count <= BVH_MAX_LEAF_SIZE)
+		return make_leaf();
+
+	std::vector<bvh_reference> left_references, right_references;
+	auto partition_objects = [&]() {
+		for (const auto& reference: references)
+		{
+			const bool left = get_bin_index(reference.bounds.get_center(), centroid_bounds, object_split.axis) <= object_split.plane;
+			(left ? left_references : right_references).push_back(reference);
+		}
+	};
+	if (use_spatial_split)
+	{
+		// Ссылка, пересекающая плоскость, режется, только если это дешевле, чем целиком отдать её одному ребёнку
+		// (reference unsplitting), и если бюджет позволяет ещё один дубликат
+		const int axis = spatial_split.axis;
+		const float position = node_bounds.aabb_min[axis] + bin_sizes[axis] * static_cast<float>(spatial_split.plane + 1);
+		const float left_area = spatial_split.left_bounds.get_area();
+		const float right_area = spatial_split.right_bounds.get_area();
+		const float left_count = static_cast<float>(spatial_split.left_count);
+		const float right_count = static_cast<float>(spatial_split.right_count);
+		for (const auto& reference: references)
+		{
+			if (reference.bounds.aabb_max[axis] <= position)
+			{
+				left_references.push_back(reference);
+				continue;
+			}
+			if (reference.bounds.aabb_min[axis] >= position)
+			{
+				right_references.push_back(reference);
+				continue;
+			}
+			aabb left_union = spatial_split.left_bounds;
+			left_union.add_aabb(reference.bounds);
+			aabb right_union = spatial_split.right_bounds;
+			right_union.add_aabb(reference.bounds);
+			const float duplicate_cost = left_area * left_count + right_area * right_count;
+			const float left_only_cost = left_union.get_area() * left_count + right_area * (right_count - 1.f);
+			const float right_only_cost = left_area * (left_count - 1.f) + right_union.get_area() * right_count;
+
+			bvh_reference left, right;
+			split_reference(reference, context.primitive_vertices, axis, position, left, right);
+			if (duplicate_cost < std::min(left_only_cost, right_only_cost) &&
+				!left.bounds.is_empty() && !right.bounds.is_empty() &&
+				context.split_budget.fetch_sub(1, std::memory_order_relaxed) > 0)
+			{
+				left_references.push_back(left);
+				right_references.push_back(right);
+			}
+			else
+			{
+				(left_only_cost <= right_only_cost ? left_references : right_references).push_back(reference);
+			}
+		}
+		// Все пересекающие ссылки ушли в одну сторону: остаётся объектное разбиение или лист
+		if (left_references.empty() || right_references.empty())
+		{
+			left_references.clear();
+			right_references.clear();
+			if (object_split.axis < 0)
+				return make_leaf();
+			partition_objects();
+		}
+	}
+	else
+	{
+		partition_objects();
+	}
+	references.clear();
+	references.shrink_to_fit();
+
+	aabb left_bounds, right_bounds;
+	for (const auto& reference: left_references)
+		left_bounds.add_aabb(reference.bounds);
+	for (const auto& reference: right_references)
+		right_bounds.add_aabb(reference.bounds);
+	const unsigned int left_child = node_counter.fetch_add(2);
+	build_nodes[left_child] = bvh_build_node{left_bounds, 0, static_cast<unsigned int>(left_references.size())};
+	build_nodes[left_child + 1] = bvh_build_node{right_bounds, 0, static_cast<unsigned int>(right_references.size())};
+
+	build_nodes[node_index].left_first = left_child;
+	build_nodes[node_index].primitive_count = 0;
+
+	// Ссылки детей живут в этом вызове, поэтому перед выходом ждём задачу левого поддерева
+	if (count >= BVH_PARALLEL_TASK_THRESHOLD)
+	{
+#pragma omp task default(none) firstprivate(left_child, depth) shared(left_references, node_counter, context)
+		subdivide_spatial(left_child, std::move(left_references), depth + 1, node_counter, context);
+	}
+	else
+	{
+		subdivide_spatial(left_child, std::move(left_references), depth + 1, node_counter, context);
+	}
+	subdivide_spatial(left_child + 1, std::move(right_references), depth + 1, node_counter, context);
+#pragma omp taskwait
+}
+
+void cg::renderer::bvh::split_reference(const bvh_reference& reference, const std::vector<float3>& primitive_vertices, int axis, float position, bvh_reference& left, bvh_reference& right)
+{
+	left = bvh_reference{aabb{}, reference.primitive};
+	right = bvh_reference{aabb{}, reference.primitive};
+	// Вершины расходятся по сторонам плоскости, точки пересечения рёбер с ней достаются обеим половинам
+	const float3* vertices = &primitive_vertices[3 * static_cast<size_t>(reference.primitive)];
+	for (int i = 0; i < 3; ++i)
+	{
+		const float3& start = vertices[i];
+		const float3& end = vertices[(i + 1) % 3];
+		if (start[axis] <= position)
+			left.bounds.add_point(start);
+		if (start[axis] >= position)
+			right.bounds.add_point(start);
+		if ((start[axis] < position && end[axis] > position) || (start[axis] > position && end[axis] < position))
+		{
+			const float t = (position - start[axis]) / (end[axis] - start[axis]);
+			float3 point = start + (end - start) * t;
+			point[axis] = position;
+			left.bounds.add_point(point);
+			right.bounds.add_point(point);
+		}
+	}
+	// Ссылка могла быть обрезана раньше: половины не выходят за её ббокс
+	left.bounds.intersect_aabb(reference.bounds);
+	right.bounds.intersect_aabb(reference.bounds);
+}
+
+void cg::renderer::bvh::build_lbvh(const std::vector<aabb>& primitive_bounds, const std::vector<float3>& centroids, std::atomic<unsigned int>& node_counter)
+{
+	aabb centroid_bounds;
+#pragma omp parallel
+#pragma omp single
+	centroid_bounds = compute_centroid_bounds(0, static_cast<unsigned int>(primitive_bounds.size()), centroids);
+
+	std::vector<unsigned int> morton_codes(primitive_bounds.size());
+#pragma omp parallel for
+	for (int i = 0; i < static_cast<int>(primitive_bounds.size()); ++i)
+		morton_codes[i] = get_morton_code(centroids[i], centroid_bounds);
+
+	// После сортировки соседние примитивы близки в пространстве, и любое поддерево — это отрезок массива
+	radix_sort(morton_codes, primitive_indices);
+
+#pragma omp parallel
+#pragma omp single
+	emit_lbvh(0, primitive_bounds, morton_codes, 1, node_counter);
+}
+
+void cg::renderer::bvh::emit_lbvh(unsigned int node_index, const std::vector<aabb>& primitive_bounds, const std::vector<unsigned int>& morton_codes, size_t depth, std::atomic<unsigned int>& node_counter)
+{
+	bvh_build_node& node = build_nodes[node_index];
+	const unsigned int first = node.left_first;
+	const unsigned int count = node.primitive_count;
+	if (count <= 1 || depth >= BVH_STACK_SIZE)
+	{
+		node.bounds = aabb{};
+		for (unsigned int i = first; i < first + count; ++i)
+			node.bounds.add_aabb(primitive_bounds[primitive_indices[i]]);
+		return;
+	}
+
+	// Делим отрезок по старшему биту, в котором расходятся коды его концов;
+	// если все коды одинаковы, делим пополам
+	const unsigned int last = first + count - 1;
+	unsigned int split = first + count / 2;
+	const unsigned int code_difference = morton_codes[first] ^ morton_codes[last];
+	if (code_difference != 0)
+	{
+		unsigned int highest_bit = 31;
+		while (!(code_difference & (1u << highest_bit)))
+			highest_bit--;
+		const unsigned int prefix_mask = ~((1u << highest_bit) - 1u);
+		const unsigned int right_prefix = morton_codes[last] & prefix_mask;
+		split = static_cast<unsigned int>(
+				std::lower_bound(
+						morton_codes.begin() + first, morton_codes.begin() + last + 1, right_prefix,
+						[&](unsigned int code, unsigned int prefix) { return (code & prefix_mask) < prefix; }) -
+				morton_codes.begin());
+	}
+
+	const unsigned int left_child = node_counter.fetch_add(2);
+	build_nodes[left_child] = bvh_build_node{aabb{}, first, split - first};
+	build_nodes[left_child + 1] = bvh_build_node{aabb{}, split, last + 1 - split};
+	node.left_first = left_child;
+	node.primitive_count = 0;
+
+	// Ббоксы считаются снизу вверх, когда оба поддерева готовы
+	if (count >= BVH_PARALLEL_TASK_THRESHOLD)
+	{
+#pragma omp task default(none) firstprivate(left_child, depth) shared(primitive_bounds, morton_codes, node_counter)
+		emit_lbvh(left_child, primitive_bounds, morton_codes, depth + 1, node_counter);
+		emit_lbvh(left_child + 1, primitive_bounds, morton_codes, depth + 1, node_counter);
+#pragma omp taskwait
+	}
+	else
+	{
+		emit_lbvh(left_child, primitive_bounds, morton_codes, depth + 1, node_counter);
+		emit_lbvh(left_child + 1, primitive_bounds, morton_codes, depth + 1, node_counter);
+	}
+
+	build_nodes[node_index].bounds = build_nodes[left_child].bounds;
+	build_nodes[node_index].bounds.add_aabb(build_nodes[left_child + 1].bounds);
+}
+
+unsigned int cg::renderer::bvh::get_morton_code(const float3& centroid, const aabb& centroid_bounds)
+{
+	constexpr unsigned int axis_cells = 1u << LBVH_MORTON_AXIS_BITS;
+	unsigned int code = 0;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const float extent = centroid_bounds.aabb_max[axis] - centroid_bounds.aabb_min[axis];
+		const float relative = extent > 0.f ? (centroid[axis] - centroid_bounds.aabb_min[axis]) / extent : 0.f;
+		const unsigned int cell = std::min(axis_cells - 1, static_cast<unsigned int>(relative * axis_cells));
+
+		// Раздвигаем биты ячейки так, чтобы между ними было по два нуля, и чередуем оси
+		unsigned int spread = cell;
+		spread = (spread * 0x00010001u) & 0xFF0000FFu;
+		spread = (spread * 0x00000101u) & 0x0F00F00Fu;
+		spread = (spread * 0x00000011u) & 0xC30C30C3u;
+		spread = (spread * 0x00000005u) & 0x49249249u;
+		code |= spread << (2 - axis);
+	}
+	return code;
+}
+
+void cg::renderer::bvh::radix_sort(std::vector<unsigned int>& keys, std::vector<unsigned int>& values)
+{
+	// LSD radix sort: каждый поток считает гистограмму своего куска,
+	// по префиксным суммам всех гистограмм потоки раскладывают свои элементы без синхронизации
+	constexpr size_t radix = 1u << LBVH_RADIX_BITS;
+	const size_t size = keys.size();
+	std::vector<unsigned int> sorted_keys(size), sorted_values(size);
+	std::vector<std::array<size_t, radix>> histograms(static_cast<size_t>(omp_get_max_threads()));
+
+	for (unsigned int shift = 0; shift < 3 * LBVH_MORTON_AXIS_BITS; shift += LBVH_RADIX_BITS)
+	{
+#pragma omp parallel
+		{
+			const size_t thread_num = static_cast<size_t>(omp_get_num_threads());
+			const size_t thread_id = static_cast<size_t>(omp_get_thread_num());
+			const size_t begin = size * thread_id / thread_num;
+			const size_t end = size * (thread_id + 1) / thread_num;
+
+			auto& histogram = histograms[thread_id];
+			histogram.fill(0);
+			for (size_t i = begin; i < end; ++i)
+				histogram[(keys[i] >> shift) & (radix - 1)]++;
+
+#pragma omp barrier
+#pragma omp single
+			{
+				size_t offset = 0;
+				for (size_t digit = 0; digit < radix; ++digit)
+				{
+					for (size_t thread = 0; thread < thread_num; ++thread)
+					{
+						const size_t digit_count = histograms[thread][digit];
+						histograms[thread][digit] = offset;
+						offset += digit_count;
+					}
+				}
+			}
+
+			for (size_t i = begin; i < end; ++i)
+			{
+				const size_t position = histogram[(keys[i] >> shift) & (radix - 1)]++;
+				sorted_keys[position] = keys[i];
+				sorted_values[position] = values[i];
+			}
+		}
+		keys.swap(sorted_keys);
+		values.swap(sorted_values);
+	}
+}
+
+void cg::renderer::bvh::optimize_treelet(unsigned int node_index, size_t depth, std::vector<float>& subtree_costs, std::vector<size_t>& subtree_heights)
+{
+	const bvh_build_node& node = build_nodes[node_index];
+	const float node_area = node.bounds.get_area();
+	if (node.is_leaf())
+	{
+		subtree_costs[node_index] = BVH_INTERSECTION_COST * node_area * static_cast<float>(node.primitive_count);
+		subtree_heights[node_index] = 1;
+		return;
+	}
+
+	// Treelet'ы обрабатываются снизу вверх: к моменту перестройки узла его поддеревья уже оптимизированы
+	const unsigned int left_child = node.left_first;
+	if (depth < BVH_PARALLEL_TREELET_DEPTH)
+	{
+#pragma omp task default(none) firstprivate(left_child, depth) shared(subtree_costs, subtree_heights)
+		optimize_treelet(left_child, depth + 1, subtree_costs, subtree_heights);
+		optimize_treelet(left_child + 1, depth + 1, subtree_costs, subtree_heights);
+#pragma omp taskwait
+	}
+	else
+	{
+		optimize_treelet(left_child, depth + 1, subtree_costs, subtree_heights);
+		optimize_treelet(left_child + 1, depth + 1, subtree_costs, subtree_heights);
+	}
+
+	const float current_cost = BVH_TRAVERSAL_COST * node_area + subtree_costs[left_child] + subtree_costs[left_child + 1];
+	subtree_costs[node_index] = current_cost;
+	subtree_heights[node_index] = 1 + std::max(subtree_heights[left_child], subtree_heights[left_child + 1]);
+
+	// Собираем treelet: раскрываем лист treelet'а с наибольшей площадью, пока листьев не станет BVH_TREELET_SIZE.
+	// Каждый раскрытый узел освобождает пару ячеек, в которую потом ляжут дети нового внутреннего узла
+	std::array<unsigned int, BVH_TREELET_SIZE> treelet_leaves{left_child, left_child + 1};
+	std::array<unsigned int, BVH_TREELET_SIZE - 1> free_pairs{left_child};
+	size_t leaf_count = 2;
+	size_t pair_count = 1;
+	while (leaf_count < BVH_TREELET_SIZE)
+	{
+		size_t expanded = leaf_count;
+		float largest_area = -1.f;
+		for (size_t i = 0; i < leaf_count; ++i)
+		{
+			const bvh_build_node& leaf = build_nodes[treelet_leaves[i]];
+			if (!leaf.is_leaf() && leaf.bounds.get_area() > largest_area)
+			{
+				largest_area = leaf.bounds.get_area();
+				expanded = i;
+			}
+		}
+		if (expanded == leaf_count)
+			break;
+		const unsigned int expanded_children = build_nodes[treelet_leaves[expanded]].left_first;
+		free_pairs[pair_count++] = expanded_children;
+		treelet_leaves[expanded] = expanded_children;
+		treelet_leaves[leaf_count++] = expanded_children + 1;
+	}
+	if (leaf_count < 3)
+		return;
+
+	// Оптимальная топология по всем подмножествам листьев: подмножества меньше по номеру считаются раньше
+	constexpr size_t subset_num = 1u << BVH_TREELET_SIZE;
+	std::array<float, subset_num> subset_costs;
+	std::array<aabb, subset_num> subset_bounds;
+	std::array<unsigned int, subset_num> subset_partitions;
+	std::array<size_t, subset_num> subset_heights;
+	const unsigned int full_subset = (1u << leaf_count) - 1u;
+	for (unsigned int subset = 1; subset <= full_subset; ++subset)
+	{
+		const unsigned int lowest = subset & (~subset + 1u);
+		if (subset == lowest)
+		{
+			const size_t leaf = static_cast<size_t>(std::log2(static_cast<float>(lowest)));
+			subset_costs[subset] = subtree_costs[treelet_leaves[leaf]];
+			subset_bounds[subset] = build_nodes[treelet_leaves[leaf]].bounds;
+			subset_heights[subset] = subtree_heights[treelet_leaves[leaf]];
+			continue;
+		}
+
+		subset_bounds[subset] = subset_bounds[lowest];
+		subset_bounds[subset].add_aabb(subset_bounds[subset ^ lowest]);
+
+		// Перебираем разбиения, в которых младший лист остаётся слева, чтобы не считать каждое дважды
+		float best_cost = std::numeric_limits<float>::max();
+		unsigned int best_partition = lowest;
+		const unsigned int rest = subset ^ lowest;
+		for (unsigned int part = (rest - 1u) & rest;; part = (part - 1u) & rest)
+		{
+			const unsigned int left = lowest | part;
+			const float cost = subset_costs[left] + subset_costs[subset ^ left];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_partition = left;
+			}
+			if (part == 0)
+				break;
+		}
+		subset_costs[subset] = BVH_TRAVERSAL_COST * subset_bounds[subset].get_area() + best_cost;
+		subset_partitions[subset] = best_partition;
+		subset_heights[subset] = 1 + std::max(subset_heights[best_partition], subset_heights[subset ^ best_partition]);
+	}
+
+	// Перестраиваем, только если стало заметно лучше и глубина дерева не превысит стек обхода
+	if (subset_costs[full_subset] >= current_cost * (1.f - 1e-5f) ||
+		depth + subset_heights[full_subset] - 1 > BVH_STACK_SIZE)
+		return;
+
+	std::array<bvh_build_node, BVH_TREELET_SIZE> leaf_nodes;
+	std::array<float, BVH_TREELET_SIZE> leaf_costs;
+	std::array<size_t, BVH_TREELET_SIZE> leaf_heights;
+	for (size_t i = 0; i < leaf_count; ++i)
+	{
+		leaf_nodes[i] = build_nodes[treelet_leaves[i]];
+		leaf_costs[i] = subtree_costs[treelet_leaves[i]];
+		leaf_heights[i] = subtree_heights[treelet_leaves[i]];
+	}
+
+	size_t used_pairs = 0;
+	std::function<void(unsigned int, unsigned int)> emit_treelet = [&](unsigned int subset, unsigned int slot) {
+		if ((subset & (subset - 1u)) == 0)
+		{
+			const size_t leaf = static_cast<size_t>(std::log2(static_cast<float>(subset)));
+			build_nodes[slot] = leaf_nodes[leaf];
+			subtree_costs[slot] = leaf_costs[leaf];
+			subtree_heights[slot] = leaf_heights[leaf];
+			return;
+		}
+		const unsigned int children = free_pairs[used_pairs++];
+		build_nodes[slot] = bvh_build_node{subset_bounds[subset], children, 0};
+		subtree_costs[slot] = subset_costs[subset];
+		subtree_heights[slot] = subset_heights[subset];
+		emit_treelet(subset_partitions[subset], children);
+		emit_treelet(subset ^ subset_partitions[subset], children + 1);
+	};
+	emit_treelet(full_subset, node_index);
+}
+
+void cg::renderer::bvh::flatten()
+{
+	// Раскладываем дерево в порядке обхода в глубину: левый ребёнок всегда следующий узел,
+	// а индекс правого становится известен, когда выложено всё левое поддерево
+	nodes.clear();
+	nodes.reserve(build_nodes.size());
+	std::vector<unsigned int> stack{0};
+	std::vector<unsigned int> parents{std::numeric_limits<unsigned int>::max()};
+	while (!stack.empty())
+	{
+		const bvh_build_node& build_node = build_nodes[stack.back()];
+		const unsigned int parent = parents.back();
+		stack.pop_back();
+		parents.pop_back();
+
+		const unsigned int node_index = static_cast<unsigned int>(nodes.size());
+		if (parent != std::numeric_limits<unsigned int>::max())
+			nodes[parent].right_first = node_index;
+
+		if (build_node.is_leaf())
+		{
+			nodes.push_back(bvh_node{build_node.bounds, build_node.left_first, build_node.primitive_count});
+			continue;
+		}
+		nodes.push_back(bvh_node{build_node.bounds, 0, 0});
+		stack.push_back(build_node.left_first + 1);
+		parents.push_back(node_index);
+		stack.push_back(build_node.left_first);
+		parents.push_back(std::numeric_limits<unsigned int>::max());
+	}
+
+	build_nodes.clear();
+	build_nodes.shrink_to_fit();
+	link_parents();
+}
+
+void cg::renderer::bvh::link_parents()
+{
+	node_parents.assign(nodes.size(), std::numeric_limits<unsigned int>::max());
+	for (unsigned int i = 0; i < nodes.size(); ++i)
+	{
+		if (nodes[i].is_leaf())
+			continue;
+		node_parents[i + 1] = i;
+		node_parents[nodes[i].right_first] = i;
+	}
+}
+
+void cg::renderer::bvh::build_wide()
+{
+	wide_nodes.reserve(nodes.size() / 2 + 1);
+	wide_child_nodes.reserve(nodes.size() / 2 + 1);
+	if (nodes[0].is_leaf())
+	{
+		// Вырожденное дерево из одного листа: корень с единственным ребёнком-листом
+		wide_bvh_node root{};
+		root.children[0] = nodes[0].right_first;
+		root.primitive_counts[0] = nodes[0].primitive_count;
+		root.child_count = 1;
+		wide_nodes.push_back(root);
+		wide_child_nodes.push_back({0});
+		set_wide_child_bounds(0, 0, nodes[0].bounds);
+		return;
+	}
+	collapse_wide_node(0);
+}
+
+unsigned int cg::renderer::bvh::collapse_wide_node(unsigned int node_index)
+{
+	// Поглощаем внуков: раскрываем внутреннего ребёнка с наибольшей площадью, пока детей не станет BVH_WIDE_WIDTH
+	std::array<unsigned int, BVH_WIDE_WIDTH> children{node_index + 1, nodes[node_index].right_first};
+	size_t child_count = 2;
+	while (child_count < BVH_WIDE_WIDTH)
+	{
+		size_t expanded = child_count;
+		float largest_area = -1.f;
+		for (size_t i = 0; i < child_count; ++i)
+		{
+			const bvh_node& child = nodes[children[i]];
+			if (!child.is_leaf() && child.bounds.get_area() > largest_area)
+			{
+				largest_area = child.bounds.get_area();
+				expanded = i;
+			}
+		}
+		if (expanded == child_count)
+			break;
+		const unsigned int expanded_node = children[expanded];
+		children[expanded] = expanded_node + 1;
+		children[child_count++] = nodes[expanded_node].right_first;
+	}
+
+	const unsigned int wide_index = static_cast<unsigned int>(wide_nodes.size());
+	wide_nodes.emplace_back();
+	wide_child_nodes.push_back(children);
+	// Вектор растёт при рекурсии, поэтому узел заполняется через индекс, а не ссылку
+	wide_nodes[wide_index].child_count = static_cast<unsigned int>(child_count);
+	for (size_t i = 0; i < BVH_WIDE_WIDTH; ++i)
+	{
+		// Пустые слоты получают вывернутый ббокс; обход всё равно отсекает их по child_count
+		set_wide_child_bounds(wide_index, i, i < child_count ? nodes[children[i]].bounds : aabb{});
+		wide_nodes[wide_index].children[i] = 0;
+		wide_nodes[wide_index].primitive_counts[i] = 0;
+	}
+	for (size_t i = 0; i < child_count; ++i)
+	{
+		const bvh_node& child = nodes[children[i]];
+		if (child.is_leaf())
+		{
+			wide_nodes[wide_index].children[i] = child.right_first;
+			wide_nodes[wide_index].primitive_counts[i] = child.primitive_count;
+		}
+		else
+		{
+			const unsigned int wide_child = collapse_wide_node(children[i]);
+			wide_nodes[wide_index].children[i] = wide_child;
+		}
+	}
+	return wide_index;
+}
+
+void cg::renderer::bvh::set_wide_child_bounds(unsigned int wide_index, size_t child, const aabb& bounds)
+{
+	wide_bvh_node& node = wide_nodes[wide_index];
+	node.min_x[child] = bounds.aabb_min.x;
+	node.min_y[child] = bounds.aabb_min.y;
+	node.min_z[child] = bounds.aabb_min.z;
+	node.max_x[child] = bounds.aabb_max.x;
+	node.max_y[child] = bounds.aabb_max.y;
+	node.max_z[child] = bounds.aabb_max.z;
+}
+
+void cg::renderer::bvh::collect_statistics()
+{
+	statistics.node_count = nodes.size();
+
+	struct entry
+	{
+		unsigned int node;
+		size_t depth;
+	};
+	std::vector<entry> stack{{0, 1}};
+	const float root_area = nodes[0].bounds.get_area();
+	size_t leaf_primitives = 0;
+	while (!stack.empty())
+	{
+		entry current = stack.back();
+		stack.pop_back();
+		const bvh_node& node = nodes[current.node];
+		const float relative_area = root_area > 0.f ? node.bounds.get_area() / root_area : 1.f;
+		statistics.max_depth = std::max(statistics.max_depth, current.depth);
+		if (node.is_leaf())
+		{
+			statistics.leaf_count++;
+			statistics.max_leaf_size = std::max(statistics.max_leaf_size, static_cast<size_t>(node.primitive_count));
+			leaf_primitives += node.primitive_count;
+			statistics.sah_cost += relative_area * BVH_INTERSECTION_COST * node.primitive_count;
+		}
+		else
+		{
+			statistics.sah_cost += relative_area * BVH_TRAVERSAL_COST;
+			stack.push_back({current.node + 1, current.depth + 1});
+			stack.push_back({node.right_first, current.depth + 1});
+		}
+	}
+	statistics.average_leaf_size = static_cast<float>(leaf_primitives) / static_cast<float>(statistics.leaf_count);
+	statistics.wide_node_count = wide_nodes.size();
+}
+
+float cg::renderer::bvh::compute_sah_cost() const
+{
+	// Та же стоимость, что в collect_statistics, но без обхода: каждый узел учитывается независимо
+	const float root_area = nodes[0].bounds.get_area();
+	float sah_cost = 0.f;
+#pragma omp parallel for reduction(+ : sah_cost)
+	for (int i = 0; i < static_cast<int>(nodes.size()); ++i)
+	{
+		const bvh_node& node = nodes[i];
+		const float relative_area = root_area > 0.f ? node.bounds.get_area() / root_area : 1.f;
+		sah_cost += relative_area * (node.is_leaf() ? BVH_INTERSECTION_COST * node.primitive_count : BVH_TRAVERSAL_COST);
+	}
+	return sah_cost;
+}
+
+const std::vector<bvh_node>& cg::renderer::bvh::get_nodes() const
+{
+	return nodes;
+}
+
+const std::vector<wide_bvh_node>& cg::renderer::bvh::get_wide_nodes() const
+{
+	return wide_nodes;
+}
+
+bool cg::renderer::bvh::supports_packets() const
+{
+	return !wide_nodes.empty();
+}
+
+const std::vector<unsigned int>& cg::renderer::bvh::get_primitive_indices() const
+{
+	return primitive_indices;
+}
+
+const bvh_statistics& cg::renderer::bvh::get_statistics() const
+{
+	return statistics;
+}
+
+void cg::renderer::bvh::print_statistics() const
+{
+	std::cout << "BVH (" << (builder == bvh_builder::lbvh ? "LBVH" : (statistics.spatial_splits ? "SBVH" : "SAH"))
+			  << (optimize_treelets ? " + treelets" : "") << "): "
+			  << statistics.primitive_count << " primitives, ";
+	if (statistics.reference_count > statistics.primitive_count)
+		std::cout << statistics.reference_count << " references, ";
+	std::cout << statistics.node_count << " nodes";
+	if (!wide_nodes.empty())
+		std::cout << " (" << statistics.wide_node_count << " " << BVH_WIDE_WIDTH << "-wide)";
+	std::cout << ", "
+			  << statistics.leaf_count << " leaves (avg " << statistics.average_leaf_size
+			  << ", max " << statistics.max_leaf_size << " primitives), "
+			  << "depth " << statistics.max_depth << ", "
+			  << "SAH cost " << statistics.sah_cost << ", "
+			  << (statistics.loaded_from_cache ? "loaded from cache in " : "built in ") << statistics.build_time << "ms";
+	if (statistics.refit_count > 0)
+		std::cout << ", refitted " << statistics.refit_count << " times (last in " << statistics.refit_time << "ms, SAH x"
+				  << statistics.sah_cost / statistics.build_sah_cost << " of the build)";
+	std::cout << "\n";
+}
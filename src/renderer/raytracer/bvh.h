@@ -0,0 +1,616 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <linalg.h>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define CG_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	static constexpr size_t BVH_BIN_NUM = 16;
+	static constexpr size_t BVH_MAX_LEAF_SIZE = 4;
+	static constexpr size_t BVH_STACK_SIZE = 64;
+	static constexpr float BVH_TRAVERSAL_COST = 1.f;
+	static constexpr float BVH_INTERSECTION_COST = 1.f;
+	// Узлы крупнее этих порогов строятся параллельно: поддеревья — задачами, корзины — по кускам
+	static constexpr unsigned int BVH_PARALLEL_TASK_THRESHOLD = 1024;
+	static constexpr unsigned int BVH_PARALLEL_BINNING_THRESHOLD = 65536;
+	// Morton-код LBVH: по 10 бит на ось, всего 30 бит
+	static constexpr unsigned int LBVH_MORTON_AXIS_BITS = 10;
+	static constexpr unsigned int LBVH_RADIX_BITS = 8;
+	// Оптимизация treelet'ов перебирает все разбиения BVH_TREELET_SIZE листьев treelet'а
+	static constexpr size_t BVH_TREELET_SIZE = 7;
+	static constexpr size_t BVH_PARALLEL_TREELET_DEPTH = 8;
+	// После refit дерево перестраивается, когда SAH-стоимость выросла во столько раз относительно построенного
+	static constexpr float BVH_REBUILD_THRESHOLD = 1.5f;
+	// Меняется вместе с раскладкой узлов и порядком массивов в файле кэша: старые файлы просто перестраиваются
+	static constexpr uint32_t BVH_CACHE_VERSION = 2;
+	// SBVH (Stich 2009) пробует пространственное разбиение, только если дети лучшего объектного
+	// перекрываются больше чем на эту долю площади корня
+	static constexpr float BVH_SPATIAL_SPLIT_ALPHA = 1e-5f;
+	static constexpr size_t BVH_SPATIAL_BIN_NUM = 16;
+	// В мелких узлах пространственное разбиение почти не снижает SAH, а стоит дорого
+	static constexpr size_t BVH_SPATIAL_SPLIT_MIN_REFERENCES = 16;
+	// Сколько дополнительных ссылок на примитивы SBVH может создать, в долях от числа примитивов
+	static constexpr float BVH_SPLIT_BUDGET = 0.3f;
+	// Широкая BVH: один SSE-тест проверяет все ббоксы детей узла
+	static constexpr size_t BVH_WIDE_WIDTH = 4;
+	// Широкий обход кладёт в стек до BVH_WIDE_WIDTH - 1 детей на каждом уровне
+	static constexpr size_t BVH_WIDE_STACK_SIZE = (BVH_WIDE_WIDTH - 1) * BVH_STACK_SIZE + 1;
+	// Пакет лучей с общим началом: 8x8 первичных лучей или теневые лучи от одного источника
+	static constexpr size_t BVH_PACKET_SIZE = 64;
+	// Маска активных лучей пакета, бит на луч
+	using bvh_ray_mask = uint64_t;
+	static constexpr bvh_ray_mask BVH_ALL_RAYS = ~bvh_ray_mask{0};
+	static_assert(BVH_PACKET_SIZE <= 8 * sizeof(bvh_ray_mask), "packet rays must fit in the ray mask");
+	// Дальняя граница slab-теста расширяется на 1 + 2 * gamma(3) (Ize 2013), иначе из-за округления
+	// луч, идущий точно по грани ббокса, пропускает его и проходит сквозь геометрию на этой грани
+	static constexpr float BVH_ROBUST_FAR_SCALE = 1.f + 2.f * (3.f * 0.5f * std::numeric_limits<float>::epsilon()) / (1.f - 3.f * 0.5f * std::numeric_limits<float>::epsilon());
+
+	enum class bvh_builder
+	{
+		sah,
+		lbvh,
+		// SAH с пространственными разбиениями: длинный наклонный треугольник режется плоскостью,
+		// и ссылки на него попадают в несколько листьев с более тесными ббоксами
+		sbvh
+	};
+
+	struct aabb
+	{
+		void add_point(const float3& point);
+		void add_aabb(const aabb& other);
+		// Оставляет только общую с other часть; если её нет, ббокс становится пустым
+		void intersect_aabb(const aabb& other);
+		float3 get_center() const;
+		float get_area() const;
+		bool is_empty() const;
+
+		bool aabb_test(const float3& position, const float3& inv_direction, float max_t, float& t_near) const;
+
+		float3 aabb_min{std::numeric_limits<float>::max()};
+		float3 aabb_max{-std::numeric_limits<float>::max()};
+	};
+
+	// Узел во время построения: дети лежат парой, чтобы задачи могли выделять их атомарным счётчиком
+	struct bvh_build_node
+	{
+		aabb bounds;
+		// Для внутреннего узла: индекс левого ребёнка, правый лежит сразу за ним
+		// Для листа: индекс первого примитива в primitive_indices
+		unsigned int left_first;
+		unsigned int primitive_count;
+
+		bool is_leaf() const { return primitive_count > 0; }
+	};
+
+	// Узел готового дерева: узлы лежат в порядке обхода в глубину, левый ребёнок идёт сразу за родителем.
+	// 32 байта — два узла на кэш-линию
+	struct alignas(32) bvh_node
+	{
+		aabb bounds;
+		// Для внутреннего узла: индекс правого ребёнка
+		// Для листа: индекс первого примитива в порядке primitive_indices
+		unsigned int right_first;
+		unsigned int primitive_count;
+
+		bool is_leaf() const { return primitive_count > 0; }
+	};
+	static_assert(sizeof(bvh_node) == 32, "BVH node should take 32 bytes");
+
+	// Узел широкой BVH: ббоксы детей лежат по компонентам (SoA), чтобы грузиться в SSE-регистры целиком.
+	// Листья хранятся прямо в родителе, отдельных узлов у них нет
+	struct alignas(64) wide_bvh_node
+	{
+		float min_x[BVH_WIDE_WIDTH];
+		float min_y[BVH_WIDE_WIDTH];
+		float min_z[BVH_WIDE_WIDTH];
+		float max_x[BVH_WIDE_WIDTH];
+		float max_y[BVH_WIDE_WIDTH];
+		float max_z[BVH_WIDE_WIDTH];
+		// Для внутреннего ребёнка: индекс узла; для листа: индекс первого примитива
+		unsigned int children[BVH_WIDE_WIDTH];
+		// 0 для внутреннего ребёнка, иначе число примитивов листа
+		unsigned int primitive_counts[BVH_WIDE_WIDTH];
+		unsigned int child_count;
+
+		// Возвращает битовую маску детей, в ббоксы которых попал луч, и расстояния до входа в них
+		int intersect(const float3& position, const float3& inv_direction, float max_t, float* t_near) const;
+		// Интервальный тест для пучка лучей из одной точки, у которых знаки компонент направления совпадают:
+		// сброшенный бит означает, что в ребёнка не попадает ни один луч пучка
+		int intersect_interval(const float3& position, const float3& inv_direction_min, const float3& inv_direction_max, float max_t, float* t_near) const;
+	};
+
+	struct bvh_ray_packet
+	{
+		float3 position;
+		std::array<float3, BVH_PACKET_SIZE> directions;
+		// Отрицательное max_t выключает луч из дальнейшего обхода
+		std::array<float, BVH_PACKET_SIZE> max_t;
+		size_t size = 0;
+	};
+
+	// Ссылка на примитив при построении SBVH: у частей разрезанного примитива ббоксы обрезаны плоскостями
+	struct bvh_reference
+	{
+		aabb bounds;
+		unsigned int primitive;
+	};
+
+	// Общее состояние задач построения SBVH
+	struct sbvh_build_context
+	{
+		const std::vector<float3>& primitive_vertices;
+		float root_area;
+		// Следующая свободная позиция в primitive_indices для ссылок листа
+		std::atomic<unsigned int> reference_counter{0};
+		// Сколько ещё ссылок можно продублировать
+		std::atomic<long long> split_budget{0};
+	};
+
+	struct bvh_bin
+	{
+		aabb bounds;
+		unsigned int count = 0;
+	};
+	using bvh_bins = std::array<std::array<bvh_bin, BVH_BIN_NUM>, 3>;
+
+	struct bvh_statistics
+	{
+		float build_time = 0.f;
+		size_t primitive_count = 0;
+		// Больше primitive_count, если SBVH разрезал примитивы
+		size_t reference_count = 0;
+		// Без вершин (например, в TLAS) SBVH строится как обычный SAH
+		bool spatial_splits = false;
+		size_t node_count = 0;
+		size_t leaf_count = 0;
+		size_t max_depth = 0;
+		size_t max_leaf_size = 0;
+		float average_leaf_size = 0.f;
+		float sah_cost = 0.f;
+		size_t wide_node_count = 0;
+		// SAH-стоимость сразу после build: с ней сравнивается стоимость после refit
+		float build_sah_cost = 0.f;
+		size_t refit_count = 0;
+		float refit_time = 0.f;
+		// Дерево прочитано из кэша, build_time — время чтения
+		bool loaded_from_cache = false;
+	};
+
+	class bvh
+	{
+	public:
+		// SAH строит дерево медленнее, но трассировка по нему быстрее;
+		// LBVH подходит для перестроения каждый кадр
+		void set_builder(bvh_builder in_builder, bool in_optimize_treelets = false);
+		bvh_builder get_builder() const;
+		// Доля дополнительных ссылок, которые SBVH может создать разрезанием примитивов
+		void set_split_budget(float in_split_budget);
+		// 2 — двоичное дерево, BVH_WIDE_WIDTH — собранное из него широкое
+		void set_width(size_t in_width);
+		// Те же построитель, оптимизация treelet и ширина, что у other
+		void copy_settings(const bvh& other);
+		// primitive_vertices — по три вершины на примитив-треугольник, нужны только SBVH, чтобы обрезать
+		// треугольники плоскостями. Без них SBVH строит то же дерево, что SAH.
+		// Разрезанный примитив встречается в get_primitive_indices() несколько раз
+		void build(const std::vector<aabb>& primitive_bounds, const std::vector<float3>& primitive_vertices = {});
+		// Примитивы сдвинулись, но их число и номера те же: ббоксы узлов пересчитываются снизу вверх
+		// без изменения топологии, так что get_primitive_indices() остаётся прежним
+		void refit(const std::vector<aabb>& primitive_bounds);
+		// Во сколько раз SAH-стоимость после refit может превысить стоимость построенного дерева
+		void set_rebuild_threshold(float in_rebuild_threshold);
+		// Дерево после refit стало слишком медленным, и его пора построить заново
+		bool needs_rebuild() const;
+		// Кэш готового дерева на диске. key описывает исходные примитивы (например, хеш файла модели),
+		// настройки построения и версия формата подмешиваются к нему сами.
+		// load возвращает false, если файла нет или он сохранён для других примитивов, настроек или версии
+		bool save(const std::filesystem::path& path, uint64_t key) const;
+		bool load(const std::filesystem::path& path, uint64_t key, size_t primitive_count);
+
+		// visit_leaf(first, count, max_t) проверяет примитивы листа и может сузить max_t;
+		// возвращает true, если обход можно прекратить.
+		// first — позиция в get_primitive_indices(): примитивы листа идут подряд,
+		// если вызывающая сторона переложила их в этом порядке
+		template<typename F>
+		void traverse(const float3& position, const float3& direction, float max_t, F&& visit_leaf) const;
+		// Обход пакетом: узел отсекается интервальным тестом сразу для всех лучей,
+		// лист посещается, если в него попал хотя бы один луч из rays.
+		// visit_leaf(first, count, packet, rays) проверяет только лучи из маски rays — те, что попали в ббокс листа
+		// ближе своего max_t, — и сужает packet.max_t попавших; возвращает true, если обход можно прекратить.
+		// Работает только по широкой BVH
+		template<typename F>
+		void traverse_packet(bvh_ray_packet& packet, F&& visit_leaf, bvh_ray_mask rays = BVH_ALL_RAYS) const;
+		bool supports_packets() const;
+
+		// 30-битный код Мортона точки в bounds и параллельная сортировка по таким ключам вместе со значениями;
+		// нужны и построителю LBVH, и сортировке потоков лучей
+		static unsigned int get_morton_code(const float3& centroid, const aabb& centroid_bounds);
+		static void radix_sort(std::vector<unsigned int>& keys, std::vector<unsigned int>& values);
+
+		const std::vector<bvh_node>& get_nodes() const;
+		const std::vector<wide_bvh_node>& get_wide_nodes() const;
+		const std::vector<unsigned int>& get_primitive_indices() const;
+		const bvh_statistics& get_statistics() const;
+		void print_statistics() const;
+
+	protected:
+		std::vector<bvh_node> nodes;
+		std::vector<bvh_build_node> build_nodes;
+		std::vector<unsigned int> primitive_indices;
+		bvh_statistics statistics;
+		bvh_builder builder = bvh_builder::sah;
+		bool optimize_treelets = false;
+		size_t width = 2;
+		float rebuild_threshold = BVH_REBUILD_THRESHOLD;
+		float split_budget = BVH_SPLIT_BUDGET;
+		std::vector<wide_bvh_node> wide_nodes;
+		// Для refit: родитель каждого узла и узлы двоичного дерева, из которых взяты дети широкого узла
+		std::vector<unsigned int> node_parents;
+		std::vector<std::array<unsigned int, BVH_WIDE_WIDTH>> wide_child_nodes;
+
+		void subdivide(unsigned int node_index, const std::vector<aabb>& primitive_bounds, const std::vector<float3>& centroids, size_t depth, std::atomic<unsigned int>& node_counter);
+		aabb compute_centroid_bounds(unsigned int first, unsigned int count, const std::vector<float3>& centroids) const;
+		bvh_bins bin_primitives(unsigned int first, unsigned int count, const aabb& centroid_bounds, const std::vector<aabb>& primitive_bounds, const std::vector<float3>& centroids) const;
+		static size_t get_bin_index(const float3& centroid, const aabb& centroid_bounds, int axis);
+
+		void build_lbvh(const std::vector<aabb>& primitive_bounds, const std::vector<float3>& centroids, std::atomic<unsigned int>& node_counter);
+		void emit_lbvh(unsigned int node_index, const std::vector<aabb>& primitive_bounds, const std::vector<unsigned int>& morton_codes, size_t depth, std::atomic<unsigned int>& node_counter);
+
+		void subdivide_spatial(unsigned int node_index, std::vector<bvh_reference> references, size_t depth, std::atomic<unsigned int>& node_counter, sbvh_build_context& context);
+		// Делит ссылку на треугольник плоскостью position по оси axis; половины не выходят за её ббокс
+		static void split_reference(const bvh_reference& reference, const std::vector<float3>& primitive_vertices, int axis, float position, bvh_reference& left, bvh_reference& right);
+
+		void optimize_treelet(unsigned int node_index, size_t depth, std::vector<float>& subtree_costs, std::vector<size_t>& subtree_heights);
+
+		void flatten();
+		void link_parents();
+		uint64_t get_cache_key(uint64_t key) const;
+		// Проверяет, что индексы детей, листьев и примитивов загруженного дерева не выходят за границы
+		bool validate(size_t primitive_count) const;
+		void build_wide();
+		unsigned int collapse_wide_node(unsigned int node_index);
+		void set_wide_child_bounds(unsigned int wide_index, size_t child, const aabb& bounds);
+
+		template<typename F>
+		void traverse_binary(const float3& position, const float3& direction, float max_t, F&& visit_leaf) const;
+		template<typename F>
+		void traverse_wide(const float3& position, const float3& direction, float max_t, F&& visit_leaf) const;
+		void collect_statistics();
+		float compute_sah_cost() const;
+	};
+
+	inline int wide_bvh_node::intersect(const float3& position, const float3& inv_direction, float max_t, float* t_near) const
+	{
+#ifdef CG_SSE
+		const __m128 position_x = _mm_set1_ps(position.x);
+		const __m128 position_y = _mm_set1_ps(position.y);
+		const __m128 position_z = _mm_set1_ps(position.z);
+		const __m128 inv_direction_x = _mm_set1_ps(inv_direction.x);
+		const __m128 inv_direction_y = _mm_set1_ps(inv_direction.y);
+		const __m128 inv_direction_z = _mm_set1_ps(inv_direction.z);
+
+		const __m128 t0_x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(min_x), position_x), inv_direction_x);
+		const __m128 t1_x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(max_x), position_x), inv_direction_x);
+		const __m128 t0_y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(min_y), position_y), inv_direction_y);
+		const __m128 t1_y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(max_y), position_y), inv_direction_y);
+		const __m128 t0_z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(min_z), position_z), inv_direction_z);
+		const __m128 t1_z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(max_z), position_z), inv_direction_z);
+
+		const __m128 near_t = _mm_max_ps(
+				_mm_max_ps(_mm_min_ps(t0_x, t1_x), _mm_min_ps(t0_y, t1_y)),
+				_mm_max_ps(_mm_min_ps(t0_z, t1_z), _mm_setzero_ps()));
+		const __m128 far_t = _mm_mul_ps(
+				_mm_set1_ps(BVH_ROBUST_FAR_SCALE),
+				_mm_min_ps(
+						_mm_min_ps(_mm_max_ps(t0_x, t1_x), _mm_max_ps(t0_y, t1_y)),
+						_mm_min_ps(_mm_max_ps(t0_z, t1_z), _mm_set1_ps(max_t))));
+		_mm_storeu_ps(t_near, near_t);
+		const int mask = _mm_movemask_ps(_mm_cmple_ps(near_t, far_t));
+#else
+		int mask = 0;
+		for (size_t i = 0; i < BVH_WIDE_WIDTH; ++i)
+		{
+			const float t0_x = (min_x[i] - position.x) * inv_direction.x;
+			const float t1_x = (max_x[i] - position.x) * inv_direction.x;
+			const float t0_y = (min_y[i] - position.y) * inv_direction.y;
+			const float t1_y = (max_y[i] - position.y) * inv_direction.y;
+			const float t0_z = (min_z[i] - position.z) * inv_direction.z;
+			const float t1_z = (max_z[i] - position.z) * inv_direction.z;
+			t_near[i] = std::max(std::max(std::min(t0_x, t1_x), std::min(t0_y, t1_y)), std::max(std::min(t0_z, t1_z), 0.f));
+			const float t_far = BVH_ROBUST_FAR_SCALE * std::min(std::min(std::max(t0_x, t1_x), std::max(t0_y, t1_y)), std::min(std::max(t0_z, t1_z), max_t));
+			if (t_near[i] <= t_far)
+				mask |= 1 << i;
+		}
+#endif
+		// Пустые слоты узла не считаются попаданиями
+		return mask & ((1 << child_count) - 1);
+	}
+
+	inline int wide_bvh_node::intersect_interval(const float3& position, const float3& inv_direction_min, const float3& inv_direction_max, float max_t, float* t_near) const
+	{
+		const float* const bounds_min[3] = {min_x, min_y, min_z};
+		const float* const bounds_max[3] = {max_x, max_y, max_z};
+		int mask = 0;
+		for (size_t i = 0; i < child_count; ++i)
+		{
+			float entry = 0.f;
+			float exit = max_t;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				// Знак направления общий для пакета, поэтому ближняя и дальняя плоскости одни и те же для всех лучей
+				const bool positive = inv_direction_min[axis] > 0.f;
+				const float near_distance = (positive ? bounds_min[axis][i] : bounds_max[axis][i]) - position[axis];
+				const float far_distance = (positive ? bounds_max[axis][i] : bounds_min[axis][i]) - position[axis];
+				entry = std::max(entry, std::min(near_distance * inv_direction_min[axis], near_distance * inv_direction_max[axis]));
+				exit = std::min(exit, std::max(far_distance * inv_direction_min[axis], far_distance * inv_direction_max[axis]));
+			}
+			t_near[i] = entry;
+			if (entry <= exit * BVH_ROBUST_FAR_SCALE)
+				mask |= 1 << i;
+		}
+		return mask;
+	}
+
+	template<typename F>
+	inline void bvh::traverse(const float3& position, const float3& direction, float max_t, F&& visit_leaf) const
+	{
+		if (!wide_nodes.empty())
+			traverse_wide(position, direction, max_t, std::forward<F>(visit_leaf));
+		else
+			traverse_binary(position, direction, max_t, std::forward<F>(visit_leaf));
+	}
+
+	template<typename F>
+	inline void bvh::traverse_wide(const float3& position, const float3& direction, float max_t, F&& visit_leaf) const
+	{
+		struct stack_entry
+		{
+			unsigned int child;
+			unsigned int primitive_count;
+			float t_near;
+		};
+
+		const float3 inv_direction = 1.f / direction;
+		std::array<stack_entry, BVH_WIDE_STACK_SIZE> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, 0, 0.f};
+		while (stack_size > 0)
+		{
+			const stack_entry entry = stack[--stack_size];
+			// Пока запись лежала в стеке, найденное пересечение могло стать ближе её ббокса
+			if (entry.t_near > max_t)
+				continue;
+
+			if (entry.primitive_count > 0)
+			{
+				if (visit_leaf(entry.child, entry.primitive_count, max_t))
+					return;
+				continue;
+			}
+
+			const wide_bvh_node& node = wide_nodes[entry.child];
+			alignas(16) float t_near[BVH_WIDE_WIDTH];
+			const int mask = node.intersect(position, inv_direction, max_t, t_near);
+
+			// Попавших детей кладём в стек от дальнего к ближнему, чтобы ближний снимался первым
+			std::array<stack_entry, BVH_WIDE_WIDTH> hits;
+			size_t hit_count = 0;
+			for (size_t i = 0; i < node.child_count; ++i)
+			{
+				if (!(mask & (1 << i)))
+					continue;
+				const stack_entry hit{node.children[i], node.primitive_counts[i], t_near[i]};
+				size_t position_in_hits = hit_count++;
+				while (position_in_hits > 0 && hits[position_in_hits - 1].t_near < hit.t_near)
+				{
+					hits[position_in_hits] = hits[position_in_hits - 1];
+					position_in_hits--;
+				}
+				hits[position_in_hits] = hit;
+			}
+			for (size_t i = 0; i < hit_count; ++i)
+				stack[stack_size++] = hits[i];
+		}
+	}
+
+	template<typename F>
+	inline void bvh::traverse_packet(bvh_ray_packet& packet, F&& visit_leaf, bvh_ray_mask rays) const
+	{
+		struct stack_entry
+		{
+			unsigned int child;
+			unsigned int primitive_count;
+			// Нижняя граница расстояния до ббокса по лучам из маски
+			float t_near;
+			// Лучи, попавшие в ббокс при тесте родителя
+			bvh_ray_mask rays;
+		};
+
+		std::array<float3, BVH_PACKET_SIZE> inv_directions;
+		float3 inv_direction_min{std::numeric_limits<float>::max()};
+		float3 inv_direction_max{-std::numeric_limits<float>::max()};
+		for (size_t i = 0; i < packet.size; ++i)
+		{
+			inv_directions[i] = 1.f / packet.directions[i];
+			inv_direction_min = min(inv_direction_min, inv_directions[i]);
+			inv_direction_max = max(inv_direction_max, inv_directions[i]);
+		}
+		if (packet.size < BVH_PACKET_SIZE)
+			rays &= (bvh_ray_mask{1} << packet.size) - 1;
+		// Интервальный тест корректен, только если по каждой оси все лучи идут в одну сторону
+		bool coherent = true;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const bool same_sign = inv_direction_min[axis] > 0.f || inv_direction_max[axis] < 0.f;
+			const bool finite = std::abs(inv_direction_min[axis]) < std::numeric_limits<float>::max() &&
+								std::abs(inv_direction_max[axis]) < std::numeric_limits<float>::max();
+			coherent = coherent && same_sign && finite;
+		}
+
+		std::array<stack_entry, BVH_WIDE_STACK_SIZE> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, 0, 0.f, rays};
+		while (stack_size > 0)
+		{
+			const stack_entry entry = stack[--stack_size];
+			// Выключаются лучи, которые уже нашли пересечения ближе этого узла или выключены совсем
+			bvh_ray_mask active = 0;
+			float packet_max_t = -1.f;
+			for (size_t i = 0; i < packet.size; ++i)
+			{
+				if ((entry.rays >> i & 1) && packet.max_t[i] >= entry.t_near)
+				{
+					active |= bvh_ray_mask{1} << i;
+					packet_max_t = std::max(packet_max_t, packet.max_t[i]);
+				}
+			}
+			if (!active)
+				continue;
+
+			if (entry.primitive_count > 0)
+			{
+				if (visit_leaf(entry.child, entry.primitive_count, packet, active))
+					return;
+				continue;
+			}
+
+			const wide_bvh_node& node = wide_nodes[entry.child];
+			alignas(16) float interval_t_near[BVH_WIDE_WIDTH] = {};
+			int candidates = (1 << node.child_count) - 1;
+			if (coherent)
+				candidates &= node.intersect_interval(packet.position, inv_direction_min, inv_direction_max, packet_max_t, interval_t_near);
+			if (!candidates)
+				continue;
+
+			// Интервальный тест консервативен, поэтому его уточняют лучи пакета. Если среди детей есть листья,
+			// каждый активный луч проверяется по всем ббоксам, и ребёнок получает маску попавших в него лучей:
+			// в листе треугольники проверяют только они. Для внутренних детей хватает первого попавшего луча,
+			// а маска переходит от родителя. Ближайшее найденное попадание задаёт порядок обхода
+			int leaf_children = 0;
+			for (size_t child = 0; child < node.child_count; ++child)
+			{
+				if (node.primitive_counts[child] > 0)
+					leaf_children |= 1 << child;
+			}
+			const bool exact_rays = (candidates & leaf_children) != 0;
+			std::array<bvh_ray_mask, BVH_WIDE_WIDTH> child_rays{};
+			std::array<float, BVH_WIDE_WIDTH> order_t;
+			order_t.fill(std::numeric_limits<float>::max());
+			alignas(16) float t_near[BVH_WIDE_WIDTH];
+			int mask = 0;
+			for (size_t i = 0; i < packet.size && (exact_rays || mask != candidates); ++i)
+			{
+				if (!(active >> i & 1))
+					continue;
+				const int hits = node.intersect(packet.position, inv_directions[i], packet.max_t[i], t_near) & candidates;
+				for (size_t child = 0; child < node.child_count; ++child)
+				{
+					if (hits & (1 << child))
+					{
+						child_rays[child] |= bvh_ray_mask{1} << i;
+						order_t[child] = std::min(order_t[child], t_near[child]);
+					}
+				}
+				mask |= hits;
+			}
+			// Нижняя граница расстояния до ребёнка должна годиться для всех лучей его маски
+			std::array<float, BVH_WIDE_WIDTH> bound_t = order_t;
+			if (!exact_rays)
+			{
+				for (size_t child = 0; child < node.child_count; ++child)
+				{
+					if (mask & (1 << child))
+					{
+						child_rays[child] = active;
+						bound_t[child] = interval_t_near[child];
+					}
+				}
+			}
+
+			std::array<stack_entry, BVH_WIDE_WIDTH> hits;
+			std::array<float, BVH_WIDE_WIDTH> hit_order_t;
+			size_t hit_count = 0;
+			for (size_t i = 0; i < node.child_count; ++i)
+			{
+				if (!child_rays[i])
+					continue;
+				const stack_entry hit{node.children[i], node.primitive_counts[i], bound_t[i], child_rays[i]};
+				size_t position_in_hits = hit_count++;
+				while (position_in_hits > 0 && hit_order_t[position_in_hits - 1] < order_t[i])
+				{
+					hits[position_in_hits] = hits[position_in_hits - 1];
+					hit_order_t[position_in_hits] = hit_order_t[position_in_hits - 1];
+					position_in_hits--;
+				}
+				hits[position_in_hits] = hit;
+				hit_order_t[position_in_hits] = order_t[i];
+			}
+			for (size_t i = 0; i < hit_count; ++i)
+				stack[stack_size++] = hits[i];
+		}
+	}
+
+	template<typename F>
+	inline void bvh::traverse_binary(const float3& position, const float3& direction, float max_t, F&& visit_leaf) const
+	{
+		if (nodes.empty())
+			return;
+
+		const float3 inv_direction = 1.f / direction;
+		float t_near;
+		if (!nodes[0].bounds.aabb_test(position, inv_direction, max_t, t_near))
+			return;
+
+		std::array<unsigned int, BVH_STACK_SIZE> stack;
+		size_t stack_size = 0;
+		unsigned int node_index = 0;
+		while (true)
+		{
+			const bvh_node& node = nodes[node_index];
+			if (node.is_leaf())
+			{
+				if (visit_leaf(node.right_first, node.primitive_count, max_t))
+					return;
+			}
+			else
+			{
+				// Сначала идём в ближний ребёнок, дальний откладываем в стек
+				unsigned int near_child = node_index + 1;
+				unsigned int far_child = node.right_first;
+				float t_left, t_right;
+				bool hit_left = nodes[near_child].bounds.aabb_test(position, inv_direction, max_t, t_left);
+				bool hit_right = nodes[far_child].bounds.aabb_test(position, inv_direction, max_t, t_right);
+				if (hit_left && hit_right)
+				{
+					if (t_right < t_left)
+						std::swap(near_child, far_child);
+					stack[stack_size++] = far_child;
+					node_index = near_child;
+					continue;
+				}
+				if (hit_left || hit_right)
+				{
+					node_index = hit_left ? near_child : far_child;
+					continue;
+				}
+			}
+
+			if (stack_size == 0)
+				return;
+			node_index = stack[--stack_size];
+		}
+	}
+}// namespace cg::renderer
@@ -0,0 +1,122 @@
+#include "light_sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+
+
+using namespace cg::renderer;
+
+void cg::renderer::light_sampler::set_lights(const std::vector<light>& in_point_lights, const std::vector<emissive_triangle>& in_triangles)
+{
+	point_lights = in_point_lights;
+	triangles = in_triangles;
+
+	// Мощность точечного источника — 4pi * интенсивность, треугольника, светящего в обе стороны, — 2pi * площадь * яркость
+	std::vector<float> powers;
+	powers.reserve(point_lights.size() + triangles.size());
+	for (const auto& point_light: point_lights)
+		powers.push_back(4.f * PI * get_luminance(point_light.color));
+	triangle_areas.resize(triangles.size());
+	for (size_t i = 0; i < triangles.size(); i++)
+	{
+		triangle_areas[i] = 0.5f * length(cross(triangles[i].b - triangles[i].a, triangles[i].c - triangles[i].a));
+		powers.push_back(2.f * PI * triangle_areas[i] * get_luminance(triangles[i].emission));
+	}
+	build_alias_table(powers);
+}
+
+bool cg::renderer::light_sampler::empty() const
+{
+	return aliases.empty();
+}
+
+light_sample cg::renderer::light_sampler::sample(const float2& selection, const float2& position) const
+{
+	const size_t bin = std::min(static_cast<size_t>(selection.x * static_cast<float>(aliases.size())), aliases.size() - 1);
+	const size_t light_id = selection.y < alias_thresholds[bin] ? bin : aliases[bin];
+
+	light_sample result{};
+	result.light_id = light_id;
+	if (light_id < point_lights.size())
+	{
+		result.position = point_lights[light_id].position;
+		result.emission = point_lights[light_id].color;
+		result.pdf = probabilities[light_id];
+		result.delta = true;
+		return result;
+	}
+
+	// Равномерная точка треугольника: корень выравнивает плотность по площади
+	const size_t triangle_id = light_id - point_lights.size();
+	const emissive_triangle& triangle = triangles[triangle_id];
+	const float root = std::sqrt(position.x);
+	result.position = triangle.a * (1.f - root) + triangle.b * (root * (1.f - position.y)) + triangle.c * (root * position.y);
+	result.normal = normalize(cross(triangle.b - triangle.a, triangle.c - triangle.a));
+	result.emission = triangle.emission;
+	result.pdf = get_triangle_pdf(triangle_id);
+	result.delta = false;
+	return result;
+}
+
+float cg::renderer::light_sampler::get_triangle_pdf(size_t triangle_id) const
+{
+	const float area = triangle_areas[triangle_id];
+	return area > 0.f ? probabilities[point_lights.size() + triangle_id] / area : 0.f;
+}
+
+void cg::renderer::light_sampler::print_statistics() const
+{
+	std::cout << "Light sampler: " << point_lights.size() << " point lights, " << triangles.size() << " emissive triangles\n";
+}
+
+void cg::renderer::light_sampler::build_alias_table(const std::vector<float>& powers)
+{
+	probabilities.clear();
+	alias_thresholds.clear();
+	aliases.clear();
+	const float total_power = std::accumulate(powers.begin(), powers.end(), 0.f);
+	if (!(total_power > 0.f))
+		return;
+
+	const size_t count = powers.size();
+	probabilities.resize(count);
+	alias_thresholds.resize(count);
+	aliases.resize(count);
+	// Корзины легче среднего добираются тяжёлыми, пока у всех не станет ровно средний вес
+	std::vector<float> scaled(count);
+	std::vector<uint32_t> small;
+	std::vector<uint32_t> large;
+	for (size_t i = 0; i < count; i++)
+	{
+		probabilities[i] = powers[i] / total_power;
+		scaled[i] = probabilities[i] * static_cast<float>(count);
+		(scaled[i] < 1.f ? small : large).push_back(static_cast<uint32_t>(i));
+	}
+	while (!small.empty() && !large.empty())
+	{
+		const uint32_t light = small.back();
+		small.pop_back();
+		const uint32_t donor = large.back();
+		alias_thresholds[light] = scaled[light];
+		aliases[light] = donor;
+		scaled[donor] -= 1.f - scaled[light];
+		if (scaled[donor] < 1.f)
+		{
+			large.pop_back();
+			small.push_back(donor);
+		}
+	}
+	// Оставшиеся корзины полные с точностью до округления
+	for (uint32_t light: small)
+	{
+		alias_thresholds[light] = 1.f;
+		aliases[light] = light;
+	}
+	for (uint32_t light: large)
+	{
+		alias_thresholds[light] = 1.f;
+		aliases[light] = light;
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "renderer/raytracer/raytracer.h"
+
+#include <cstdint>
+#include <linalg.h>
+#include <vector>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	// Светящийся треугольник сцены: emission — излучаемая яркость с обеих сторон
+	struct emissive_triangle
+	{
+		float3 a;
+		float3 b;
+		float3 c;
+		float3 emission;
+	};
+
+	// Точка на источнике для next-event estimation. Для треугольника pdf — плотность по площади,
+	// для точечного источника (delta) — вероятность его выбора
+	struct light_sample
+	{
+		float3 position;
+		float3 normal;
+		float3 emission;
+		float pdf;
+		size_t light_id;
+		bool delta;
+	};
+
+	// Степенная эвристика MIS: вес стратегии с плотностью pdf, когда та же точка достижима и стратегией other_pdf
+	inline float get_power_heuristic(float pdf, float other_pdf)
+	{
+		const float pdf_squared = pdf * pdf;
+		const float sum = pdf_squared + other_pdf * other_pdf;
+		return sum > 0.f ? pdf_squared / sum : 0.f;
+	}
+
+	// Выбирает источник пропорционально мощности по таблице псевдонимов (Vose): выбор стоит O(1)
+	// при любом числе источников. Номера: сначала точечные источники, затем треугольники
+	class light_sampler
+	{
+	public:
+		void set_lights(const std::vector<light>& in_point_lights, const std::vector<emissive_triangle>& in_triangles);
+		bool empty() const;
+
+		// selection выбирает источник, position — точку на треугольнике; оба в [0, 1)^2
+		light_sample sample(const float2& selection, const float2& position) const;
+		// Плотность по площади, с которой sample выбирает точки треугольника triangle_id: нужна для MIS
+		// попаданий в источник по направлению из BSDF
+		float get_triangle_pdf(size_t triangle_id) const;
+
+		void print_statistics() const;
+
+	protected:
+		std::vector<light> point_lights;
+		std::vector<emissive_triangle> triangles;
+		std::vector<float> triangle_areas;
+		std::vector<float> probabilities;
+		// Корзина i выбирает себя с вероятностью alias_thresholds[i], иначе — aliases[i]
+		std::vector<float> alias_thresholds;
+		std::vector<uint32_t> aliases;
+
+		void build_alias_table(const std::vector<float>& powers);
+	};
+}// namespace cg::renderer
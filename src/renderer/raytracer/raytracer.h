@@ -1,12 +1,21 @@
 #pragma once
 
+#include "renderer/raytracer/bvh.h"
+#include "renderer/raytracer/sampler.h"
+#include "renderer/raytracer/tile_scheduler.h"
 #include "resource.h"
+#include "utils/error_handler.h"
 
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <memory>
+#include <numeric>
 #include <omp.h>
-#include <random>
+#include <string>
 
 using namespace linalg::aliases;
 
@@ -14,6 +23,7 @@ namespace cg::renderer
 {
 	struct ray
 	{
+		ray() = default;
 		ray(float3 position, float3 direction) : position(position)
 		{
 			this->direction = normalize(direction);
@@ -27,27 +37,31 @@ namespace cg::renderer
 		float t;
 		float3 bary;
 		cg::color color;
+		// Куда попал луч: номер экземпляра и номер треугольника в его сетке
+		unsigned int instance_id;
+		unsigned int primitive_id;
 	};
 
 	template<typename VB>
 	struct triangle
 	{
+		triangle() = default;
 		triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c);
 
-		float3 a;
-		float3 b;
-		float3 c;
+		float3 a{};
+		float3 b{};
+		float3 c{};
 
-		float3 ba;
-		float3 ca;
+		float3 ba{};
+		float3 ca{};
 
-		float3 na;
-		float3 nb;
-		float3 nc;
+		float3 na{};
+		float3 nb{};
+		float3 nc{};
 
-		float3 ambient;
-		float3 diffuse;
-		float3 emissive;
+		float3 ambient{};
+		float3 diffuse{};
+		float3 emissive{};
 	};
 
 	template<typename VB>
@@ -55,23 +69,209 @@ namespace cg::renderer
 			const VB& vertex_a, const VB& vertex_b, const VB& vertex_c)
 	{
 		// TODO Lab: 2.02 Implement a constructor of `triangle` struct
+		a = vertex_a.position;
+		b = vertex_b.position;
+		c = vertex_c.position;
+
+		ba = b - a;
+		ca = c - a;
+
+		na = vertex_a.normal;
+		nb = vertex_b.normal;
+		nc = vertex_c.normal;
+
+		ambient = vertex_a.ambient;
+		diffuse = vertex_a.diffuse;
+		emissive = vertex_a.emissive;
 	}
 
-	template<typename VB>
-	class aabb
+	static constexpr size_t TRIANGLE_PACKET_SIZE = 4;
+	// Адаптивная выборка: первые проходы идут по всему кадру, шумная плитка получает
+	// не больше ADAPTIVE_MAX_SAMPLES_SCALE * accumulation_num отсчётов
+	static constexpr size_t ADAPTIVE_MIN_SAMPLES = 4;
+	static constexpr size_t ADAPTIVE_MAX_SAMPLES_SCALE = 4;
+	// Не даёт относительной ошибке тёмных пикселей уходить в бесконечность
+	static constexpr float ADAPTIVE_LUMINANCE_EPSILON = 0.05f;
+	static constexpr size_t RAY_PACKET_TILE_SIZE = 8;
+	// Даже яркий путь русская рулетка иногда обрывает: иначе пути между зеркалами не кончаются
+	static constexpr float RUSSIAN_ROULETTE_MAX_SURVIVAL = 0.95f;
+	static constexpr float PI = 3.14159265f;
+	static constexpr float INV_PI = 1.f / PI;
+	static_assert(RAY_PACKET_TILE_SIZE * RAY_PACKET_TILE_SIZE <= BVH_PACKET_SIZE, "Ray packet tile should fit a BVH packet");
+
+	// Горячие данные для пересечения: вершины TRIANGLE_PACKET_SIZE треугольников по компонентам (SoA).
+	// Храним сами вершины, а не рёбра: водонепроницаемому тесту нужны точно те же координаты
+	// общих вершин у соседних треугольников. Рёбра для Мёллера–Трумбора считаются на лету.
+	// Нормали и цвета остаются в triangle<VB> и читаются только для ближайшего попадания
+	struct alignas(16) triangle_packet
 	{
-	public:
-		void add_triangle(const triangle<VB> triangle);
-		const std::vector<triangle<VB>>& get_triangles() const;
-		bool aabb_test(const ray& ray) const;
+		float a[3][TRIANGLE_PACKET_SIZE];
+		float b[3][TRIANGLE_PACKET_SIZE];
+		float c[3][TRIANGLE_PACKET_SIZE];
+	};
 
-	protected:
+	// Сдвиг и сдвиговое преобразование луча для водонепроницаемого теста (Woop et al. 2013):
+	// после него луч идёт вдоль оси z из начала координат, считается один раз на луч
+	struct ray_shear
+	{
+		ray_shear() = default;
+		ray_shear(const ray& ray);
+
+		int kx;
+		int ky;
+		int kz;
+		float sx;
+		float sy;
+		float sz;
+	};
+
+	inline ray_shear::ray_shear(const ray& ray)
+	{
+		const float3 abs_direction = abs(ray.direction);
+		kz = abs_direction.x > abs_direction.y ? (abs_direction.x > abs_direction.z ? 0 : 2) : (abs_direction.y > abs_direction.z ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		// Сохраняем ориентацию обхода вершин
+		if (ray.direction[kz] < 0.f)
+			std::swap(kx, ky);
+
+		sx = ray.direction[kx] / ray.direction[kz];
+		sy = ray.direction[ky] / ray.direction[kz];
+		sz = 1.f / ray.direction[kz];
+	}
+
+	// Ближайшее из попаданий, отмеченных в hit_mask; u и v — барицентрические веса вершин b и c
+	inline payload get_closest_lane(int hit_mask, const float* t, const float* u, const float* v, size_t& lane)
+	{
+		payload payload{};
+		payload.t = -1.f;
+		for (size_t i = 0; i < TRIANGLE_PACKET_SIZE; i++)
+		{
+			if ((hit_mask & (1 << i)) && (payload.t < 0.f || t[i] < payload.t))
+			{
+				payload.t = t[i];
+				payload.bary = float3{1.f - u[i] - v[i], u[i], v[i]};
+				lane = i;
+			}
+		}
+		return payload;
+	}
+
+	// Слоты пакета packet_id, попадающие в лист [first, first + count)
+	inline int get_lane_mask(size_t packet_id, unsigned int first, unsigned int count)
+	{
+		int lane_mask = 0;
+		for (size_t lane = 0; lane < TRIANGLE_PACKET_SIZE; lane++)
+		{
+			const size_t primitive = packet_id * TRIANGLE_PACKET_SIZE + lane;
+			if (primitive >= first && primitive < first + count)
+				lane_mask |= 1 << lane;
+		}
+		return lane_mask;
+	}
+
+	// Нижний уровень: треугольники одной сетки в её собственных координатах, их пакеты и BVH над ними
+	template<typename VB>
+	struct bottom_level_structure
+	{
 		std::vector<triangle<VB>> triangles;
+		std::vector<triangle_packet> triangle_packets;
+		bvh acceleration_structure;
+	};
+
+	// Экземпляр сетки mesh_id: лучи переводятся в координаты сетки через world_to_object
+	struct mesh_instance
+	{
+		size_t mesh_id;
+		float4x4 object_to_world;
+		float4x4 world_to_object;
+	};
+
+	// Направление не нормируется: параметр t вдоль луча одинаков в мире и в координатах сетки
+	inline ray transform_ray(const float4x4& transform, const ray& in_ray)
+	{
+		ray result;
+		result.position = mul(transform, float4{in_ray.position, 1.f}).xyz();
+		result.direction = mul(transform, float4{in_ray.direction, 0.f}).xyz();
+		return result;
+	}
+
+	// Накопленная статистика пикселя: среднее цвета и сумма квадратов отклонений яркости (алгоритм Уэлфорда)
+	struct pixel_statistics
+	{
+		float3 mean;
+		float m2;
+		unsigned int sample_count;
+
+		void add_sample(const float3& color);
+		// Стандартная ошибка среднего яркости относительно самой яркости
+		float get_relative_error() const;
+	};
+
+	inline float get_luminance(const float3& color)
+	{
+		return dot(color, float3{0.2126f, 0.7152f, 0.0722f});
+	}
+
+	inline void pixel_statistics::add_sample(const float3& color)
+	{
+		const float previous_luminance = get_luminance(mean);
+		sample_count++;
+		mean += (color - mean) / static_cast<float>(sample_count);
+		m2 += (get_luminance(color) - previous_luminance) * (get_luminance(color) - get_luminance(mean));
+	}
 
-		float3 aabb_min;
-		float3 aabb_max;
+	inline float pixel_statistics::get_relative_error() const
+	{
+		if (sample_count < 2)
+			return std::numeric_limits<float>::max();
+		const float variance = m2 / static_cast<float>(sample_count - 1);
+		return std::sqrt(variance / static_cast<float>(sample_count)) / (get_luminance(mean) + ADAPTIVE_LUMINANCE_EPSILON);
+	}
+
+	struct adaptive_sampling_statistics
+	{
+		bool adaptive;
+		size_t pass_count;
+		float average_samples;
+		size_t min_samples;
+		size_t max_samples;
+		size_t converged_tiles;
+		// Среднее число отрезков пути на отсчёт при трассировке отскоков волновым фронтом
+		float average_path_length;
+	};
+
+	// Луч волнового фронта: продолжение пути пикселя pixel_id, вклад которого ослаблен в throughput раз
+	struct stream_ray
+	{
+		ray segment;
+		float3 throughput;
+		unsigned int pixel_id;
+		unsigned int sample_index;
+		float scatter_pdf;
 	};
 
+	// Какой отсчёт какого пикселя шейдится и сколько измерений он уже взял.
+	// scatter_pdf — плотность направления, которым путь пришёл в точку, для MIS; 0 — луч из камеры
+	struct path_sample_context
+	{
+		uint2 pixel;
+		uint32_t sample_index;
+		uint32_t dimension;
+		float scatter_pdf;
+	};
+
+	// Пути, которые сейчас шейдит поток: по одному на луч пакета.
+	// Одиночные шейдеры видят путь active_path
+	struct alignas(64) path_thread_context
+	{
+		std::array<path_sample_context, BVH_PACKET_SIZE> paths;
+		size_t active_path;
+	};
+
+	// Ключ сортировки потока: октант направления в старших битах, под ним код Мортона начала луча
+	static constexpr unsigned int STREAM_OCTANT_SHIFT = 3 * LBVH_MORTON_AXIS_BITS - 3;
+
 	struct light
 	{
 		float3 position;
@@ -89,33 +289,149 @@ namespace cg::renderer
 		void clear_render_target(const RT& in_clear_value);
 		void set_viewport(size_t in_width, size_t in_height);
 
+		// Формы сетки 0
 		void set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers);
 		void set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers);
+		// Ещё одна сетка для экземпляров; возвращает её номер
+		size_t add_mesh(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers, std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers);
+		// Без экземпляров сцена — сетка 0 в мировых координатах, и верхний уровень при обходе пропускается
+		void add_instance(size_t mesh_id, const float4x4& object_to_world);
+		// BVH сетки 0 читается из файла cache_path, если он сохранён для того же cache_key и тех же настроек;
+		// иначе строится и сохраняется туда. cache_key должен меняться вместе с геометрией сетки
+		void set_acceleration_structure_cache(const std::filesystem::path& in_cache_path, uint64_t in_cache_key);
 		void build_acceleration_structure();
-		std::vector<aabb<VB>> acceleration_structures;
+		// Вершины в буферах сдвинулись, а индексы те же (скелетная анимация, деформации): BVH всех уровней
+		// подгоняются под новые ббоксы без перестроения. Сетка, чья SAH-стоимость выросла больше порога
+		// acceleration_structure.set_rebuild_threshold, перестраивается, и порядок её треугольников меняется
+		void refit_acceleration_structure();
+		// Верхний уровень над экземплярами. Нижние уровни строятся с его настройками
+		bvh acceleration_structure;
+		void print_acceleration_structure_statistics() const;
+		// Плитки кадра в порядке кривой Гильберта, раздаются потокам с воровством
+		tile_scheduler scheduler;
+		void set_tile_size(size_t in_tile_size);
 
 		void ray_generation(float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num);
+		// Порог относительной ошибки среднего, ниже которого плитка больше не сэмплируется; 0 — без адаптивности
+		void set_adaptive_threshold(float in_adaptive_threshold);
+		// Проходы продолжаются, пока следующий успевает до срока; 0 — без ограничения
+		void set_time_budget(float in_time_budget_ms);
+		// Начиная с этого отрезка путь продолжается с вероятностью по своей пропускной способности;
+		// depth в ray_generation остаётся жёстким пределом. 0 — без русской рулетки
+		void set_russian_roulette_depth(size_t in_russian_roulette_depth);
+		const adaptive_sampling_statistics& get_sampling_statistics() const;
+		void print_sampling_statistics() const;
 
 		payload trace_ray(const ray& ray, size_t depth, float max_t = 1000.f, float min_t = 0.001f) const;
+		// Есть ли хоть одно пересечение в (min_t, max_t): без шейдеров и без поиска ближайшего
+		bool occluded(const ray& ray, float max_t, float min_t = 0.001f) const;
+
+		// Пакетные запросы для лучей с общим началом (не больше BVH_PACKET_SIZE):
+		// ближайшие попадания, hit_triangles[i] == nullptr при промахе
+		void closest_hit_packet(const ray* rays, size_t count, payload* payloads, const triangle<VB>** hit_triangles, float max_t = 1000.f, float min_t = 0.001f) const;
+		// Видимость точек targets из origin — теневые лучи к одному источнику, пущенные от него самого
+		void occluded_packet(const float3& origin, const float3* targets, size_t count, bool* result, float min_t = 0.001f) const;
+		void set_packet_tracing(bool in_packet_tracing);
 		payload intersection_shader(const triangle<VB>& triangle, const ray& ray) const;
+		// Möller–Trumbore сразу для всех треугольников пакета из lane_mask;
+		// возвращает ближайшее попадание в (min_t, max_t) и его номер в пакете
+		payload intersection_shader(const triangle_packet& packet, const ray& ray, int lane_mask, float min_t, float max_t, size_t& lane) const;
+		// То же, но без щелей на общих рёбрах: луч не проскакивает между соседними треугольниками
+		payload watertight_intersection_shader(const triangle_packet& packet, const ray& ray, const ray_shear& shear, int lane_mask, float min_t, float max_t, size_t& lane) const;
+		void set_watertight(bool in_watertight);
 
 		std::function<payload(const ray& ray)> miss_shader = nullptr;
 		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth)>
 				closest_hit_shader = nullptr;
 		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle)> any_hit_shader =
 				nullptr;
+		// Шейдер сразу для всех попаданий пакета первичных лучей: позволяет пустить теневые лучи тоже пакетом.
+		// Промахи отмечены triangles[i] == nullptr, их payload уже заполнен miss_shader
+		std::function<void(const ray* rays, payload* payloads, const triangle<VB>* const* triangles, size_t count, size_t depth)>
+				closest_hit_packet_shader = nullptr;
+		// Продолжение пути после попадания: выбирает следующий луч, ослабление вдоль него и плотность,
+		// с которой выбрано направление (0 — без MIS, например зеркальное отражение).
+		// Если задан и depth > 1, отскоки трассируются волновым фронтом, а не рекурсией из closest_hit_shader
+		std::function<bool(const ray& ray, const payload& payload, const triangle<VB>& triangle, cg::renderer::ray& scattered, float3& attenuation, float& pdf)>
+				scatter_shader = nullptr;
 
-		float2 get_jitter(int frame_id);
+		// Сдвиг отсчёта sample_index внутри пикселя в пределах [-0.5, 0.5)
+		float2 get_jitter(const uint2& pixel, uint32_t sample_index) const;
+		void set_sampler(sampler_type in_sampler_type);
+		// Следующая пара измерений пути, который сейчас шейдит поток. Доступна из scatter_shader
+		// и из closest_hit_shader; на каждом отскоке измерения свои
+		float2 get_sample_2d() const;
+		// То же для луча path_id пакета, который получил closest_hit_packet_shader
+		float2 get_sample_2d(size_t path_id) const;
+		// Плотность направления, которым луч path_id пакета пришёл в точку попадания; 0 — луч из камеры
+		float get_scatter_pdf(size_t path_id) const;
+		const std::vector<bottom_level_structure<VB>>& get_meshes() const;
+		// Экземпляры в порядке листьев верхнего уровня: payload::instance_id — номер в этом массиве
+		const std::vector<mesh_instance>& get_instances() const;
 
 	protected:
 		std::shared_ptr<cg::resource<RT>> render_target;
-		std::shared_ptr<cg::resource<float3>> history;
+		std::shared_ptr<cg::resource<pixel_statistics>> history;
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 		std::vector<std::shared_ptr<cg::resource<VB>>> vertex_buffers;
-		std::vector<triangle<VB>> triangles;
+		std::vector<std::vector<std::shared_ptr<cg::resource<unsigned int>>>> mesh_index_buffers;
+		std::vector<std::vector<std::shared_ptr<cg::resource<VB>>>> mesh_vertex_buffers;
+		std::vector<bottom_level_structure<VB>> meshes;
+		std::vector<mesh_instance> instances;
+		std::vector<mesh_instance> top_level_instances;
+		bool flat_scene = true;
+		std::filesystem::path cache_path;
+		uint64_t cache_key = 0;
+		bool watertight = false;
+		bool packet_tracing = false;
+		size_t tile_size = TILE_SIZE;
+		float adaptive_threshold = 0.f;
+		float time_budget_ms = 0.f;
+		size_t russian_roulette_depth = 0;
+		adaptive_sampling_statistics sampling_statistics{};
+		cg::renderer::sampler path_sampler;
+		mutable std::vector<path_thread_context> sample_contexts;
 
 		size_t width = 1920;
 		size_t height = 1080;
+
+		// Без mesh_cache_path дерево всегда строится
+		void build_bottom_level(bottom_level_structure<VB>& mesh, const std::vector<std::shared_ptr<cg::resource<VB>>>& mesh_vertex_buffers, const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& mesh_index_buffers, const std::filesystem::path& mesh_cache_path = {});
+		void refit_bottom_level(bottom_level_structure<VB>& mesh, const std::vector<std::shared_ptr<cg::resource<VB>>>& mesh_vertex_buffers, const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& mesh_index_buffers);
+		// Треугольники сетки в порядке буферов и их ббоксы
+		static std::vector<aabb> read_triangles(std::vector<triangle<VB>>& triangles, const std::vector<std::shared_ptr<cg::resource<VB>>>& mesh_vertex_buffers, const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& mesh_index_buffers);
+		// Вершины треугольников подряд, по три на треугольник, если построителю они нужны (SBVH); иначе пусто
+		static std::vector<float3> get_triangle_vertices(const bottom_level_structure<VB>& mesh);
+		// Перекладывает треугольники в порядок листьев BVH сетки и собирает из них пакеты.
+		// Треугольник, разрезанный SBVH, повторяется в каждом листе, где на него есть ссылка
+		static void order_triangles(bottom_level_structure<VB>& mesh);
+		// Мировые ббоксы экземпляров, номер — как в scene_instances
+		std::vector<aabb> get_instance_bounds(const std::vector<mesh_instance>& scene_instances) const;
+		// Обходит верхний уровень и вызывает visit_mesh(instance_id, mesh, object_ray, current_max_t) для экземпляров,
+		// в ббоксы которых попал луч; луч уже переведён в координаты сетки. true из visit_mesh прекращает обход
+		template<typename F>
+		void traverse_instances(const ray& ray, float max_t, F&& visit_mesh) const;
+		// То же для пакета лучей с общим началом: visit_mesh(instance_id, mesh, object_packet, object_rays, rays),
+		// где rays — лучи пакета, попавшие в ббокс экземпляра
+		template<typename F>
+		void traverse_instances_packet(bvh_ray_packet& packet, const ray* rays, F&& visit_mesh) const;
+		payload intersect_triangle_packet(const bottom_level_structure<VB>& mesh, size_t packet_id, const ray& ray, const ray_shear& shear, int lane_mask, float min_t, float max_t, size_t& lane) const;
+		// Ближайшее попадание среди треугольников листа [first, first + count); primitive — номер треугольника в сетке
+		payload intersect_leaf(const bottom_level_structure<VB>& mesh, unsigned int first, unsigned int count, const ray& ray, const ray_shear& shear, float min_t, float max_t, size_t& primitive) const;
+		// Шейдеры получают треугольник в мировых координатах: для экземпляра он пересчитывается в storage
+		const triangle<VB>* get_world_triangle(const triangle<VB>* hit_triangle, const payload& payload, triangle<VB>& storage) const;
+		// Ближайшее попадание одного луча без шейдеров; first_hit — остановиться на первом найденном
+		payload closest_hit(const ray& ray, const triangle<VB>*& hit_triangle, bool first_hit = false, float max_t = 1000.f, float min_t = 0.001f) const;
+		// Промахи уходят в miss_shader, попадания — в closest_hit_packet_shader или по одному в closest_hit_shader
+		void shade_packet(const ray* rays, size_t count, size_t depth, payload* payloads, const triangle<VB>* const* hit_triangles) const;
+		void trace_ray_packet(const ray* rays, size_t count, size_t depth, payload* payloads) const;
+
+		// Одна стадия волнового фронта: трассирует поток пачками по BVH_PACKET_SIZE лучей, добавляет их вклад
+		// в radiance и заменяет поток продолжениями путей
+		void trace_stream(std::vector<stream_ray>& stream, size_t depth, bool packets, std::vector<float3>& radiance, size_t bounce);
+		void sort_stream(std::vector<stream_ray>& stream) const;
+		void begin_path_sample(size_t thread_id, size_t path_id, const uint2& pixel, uint32_t sample_index, size_t bounce, float scatter_pdf = 0.f) const;
+		void select_path(size_t thread_id, size_t path_id) const;
 	};
 
 	template<typename VB, typename RT>
@@ -123,6 +439,7 @@ namespace cg::renderer
 			std::shared_ptr<resource<RT>> in_render_target)
 	{
 		// TODO Lab: 2.01 Implement `set_render_target`, `set_viewport`, and `clear_render_target` methods of `raytracer` class
+		render_target = in_render_target;
 	}
 
 	template<typename VB, typename RT>
@@ -131,6 +448,53 @@ namespace cg::renderer
 	{
 		// TODO Lab: 2.01 Implement `set_render_target`, `set_viewport`, and `clear_render_target` methods of `raytracer` class
 		// TODO Lab: 2.06 Add `history` resource in `raytracer` class
+		width = in_width;
+		height = in_height;
+		history = std::make_shared<cg::resource<pixel_statistics>>(width, height);
+		scheduler.set_viewport(width, height, tile_size);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_adaptive_threshold(float in_adaptive_threshold)
+	{
+		adaptive_threshold = in_adaptive_threshold;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_time_budget(float in_time_budget_ms)
+	{
+		time_budget_ms = in_time_budget_ms;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_russian_roulette_depth(size_t in_russian_roulette_depth)
+	{
+		russian_roulette_depth = in_russian_roulette_depth;
+	}
+
+	template<typename VB, typename RT>
+	inline const adaptive_sampling_statistics& raytracer<VB, RT>::get_sampling_statistics() const
+	{
+		return sampling_statistics;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::print_sampling_statistics() const
+	{
+		std::cout << "Sampling: " << sampling_statistics.pass_count << " passes, " << sampling_statistics.average_samples << " samples per pixel on average "
+				  << "(min " << sampling_statistics.min_samples << ", max " << sampling_statistics.max_samples << ")";
+		if (sampling_statistics.adaptive)
+			std::cout << ", " << sampling_statistics.converged_tiles << " of " << scheduler.get_tiles().size() << " tiles converged";
+		if (sampling_statistics.average_path_length > 0.f)
+			std::cout << ", " << sampling_statistics.average_path_length << " segments per path on average";
+		std::cout << "\n";
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_tile_size(size_t in_tile_size)
+	{
+		tile_size = in_tile_size;
+		scheduler.set_viewport(width, height, tile_size);
 	}
 
 	template<typename VB, typename RT>
@@ -139,18 +503,48 @@ namespace cg::renderer
 	{
 		// TODO Lab: 2.01 Implement `set_render_target`, `set_viewport`, and `clear_render_target` methods of `raytracer` class
 		// TODO Lab: 2.06 Add `history` resource in `raytracer` class
+		if (render_target)
+			render_target->clear(in_clear_value);
+		if (history)
+			history->clear(pixel_statistics{float3{0.f, 0.f, 0.f}, 0.f, 0});
 	}
 
 	template<typename VB, typename RT>
 	inline void raytracer<VB, RT>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers)
 	{
 		// TODO Lab: 2.02 Implement `set_vertex_buffers` and `set_index_buffers` of `raytracer` class
+		vertex_buffers = in_vertex_buffers;
 	}
 
 	template<typename VB, typename RT>
 	void raytracer<VB, RT>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers)
 	{
 		// TODO Lab: 2.02 Implement `set_vertex_buffers` and `set_index_buffers` of `raytracer` class
+		index_buffers = in_index_buffers;
+	}
+
+	template<typename VB, typename RT>
+	inline size_t raytracer<VB, RT>::add_mesh(
+			std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers, std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers)
+	{
+		mesh_vertex_buffers.push_back(in_vertex_buffers);
+		mesh_index_buffers.push_back(in_index_buffers);
+		return mesh_vertex_buffers.size();
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::add_instance(size_t mesh_id, const float4x4& object_to_world)
+	{
+		if (mesh_id > mesh_vertex_buffers.size())
+			THROW_ERROR("Unknown mesh: " + std::to_string(mesh_id));
+		instances.push_back({mesh_id, object_to_world, inverse(object_to_world)});
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_acceleration_structure_cache(const std::filesystem::path& in_cache_path, uint64_t in_cache_key)
+	{
+		cache_path = in_cache_path;
+		cache_key = in_cache_key;
 	}
 
 	template<typename VB, typename RT>
@@ -158,6 +552,201 @@ namespace cg::renderer
 	{
 		// TODO Lab: 2.02 Fill `triangles` vector in `build_acceleration_structure` of `raytracer` class
 		// TODO Lab: 2.05 Implement `build_acceleration_structure` method of `raytracer` class
+		// Каждая сетка хранится и строится один раз, сколько бы экземпляров на неё ни ссылалось
+		meshes.clear();
+		meshes.resize(mesh_vertex_buffers.size() + 1);
+		build_bottom_level(meshes[0], vertex_buffers, index_buffers, cache_path);
+		for (size_t mesh_id = 1; mesh_id < meshes.size(); mesh_id++)
+			build_bottom_level(meshes[mesh_id], mesh_vertex_buffers[mesh_id - 1], mesh_index_buffers[mesh_id - 1]);
+
+		flat_scene = instances.empty();
+		std::vector<mesh_instance> scene_instances = instances;
+		if (flat_scene)
+		{
+			const float4x4 identity{{1.f, 0.f, 0.f, 0.f}, {0.f, 1.f, 0.f, 0.f}, {0.f, 0.f, 1.f, 0.f}, {0.f, 0.f, 0.f, 1.f}};
+			scene_instances.push_back({0, identity, identity});
+		}
+		// У пустой сетки нет ббокса: её экземпляры не попадают в верхний уровень, а не вставляются туда пустой коробкой
+		scene_instances.erase(
+				std::remove_if(scene_instances.begin(), scene_instances.end(), [&](const mesh_instance& instance) {
+					return meshes[instance.mesh_id].acceleration_structure.get_nodes().empty();
+				}),
+				scene_instances.end());
+
+		acceleration_structure.build(get_instance_bounds(scene_instances));
+
+		top_level_instances.clear();
+		top_level_instances.reserve(scene_instances.size());
+		for (unsigned int primitive: acceleration_structure.get_primitive_indices())
+			top_level_instances.push_back(scene_instances[primitive]);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::refit_acceleration_structure()
+	{
+		refit_bottom_level(meshes[0], vertex_buffers, index_buffers);
+		for (size_t mesh_id = 1; mesh_id < meshes.size(); mesh_id++)
+			refit_bottom_level(meshes[mesh_id], mesh_vertex_buffers[mesh_id - 1], mesh_index_buffers[mesh_id - 1]);
+
+		// Экземпляры остаются на местах, меняются только ббоксы сеток. Верхний уровень тоже подгоняется,
+		// ббоксы для него — в исходном порядке экземпляров, а top_level_instances уже лежат в порядке листьев
+		const std::vector<aabb> leaf_bounds = get_instance_bounds(top_level_instances);
+		const std::vector<unsigned int>& primitive_indices = acceleration_structure.get_primitive_indices();
+		std::vector<aabb> instance_bounds(leaf_bounds.size());
+		for (size_t i = 0; i < leaf_bounds.size(); i++)
+			instance_bounds[primitive_indices[i]] = leaf_bounds[i];
+		acceleration_structure.refit(instance_bounds);
+		if (!acceleration_structure.needs_rebuild())
+			return;
+
+		const std::vector<mesh_instance> scene_instances = top_level_instances;
+		acceleration_structure.build(leaf_bounds);
+		top_level_instances.clear();
+		for (unsigned int primitive: acceleration_structure.get_primitive_indices())
+			top_level_instances.push_back(scene_instances[primitive]);
+	}
+
+	template<typename VB, typename RT>
+	inline std::vector<aabb> raytracer<VB, RT>::get_instance_bounds(const std::vector<mesh_instance>& scene_instances) const
+	{
+		// Верхний уровень — BVH над мировыми ббоксами экземпляров: углы ббокса сетки переводятся в мир.
+		// Экземпляры пустых сеток сюда не передаются
+		std::vector<aabb> instance_bounds(scene_instances.size());
+		for (size_t i = 0; i < scene_instances.size(); i++)
+		{
+			const bottom_level_structure<VB>& mesh = meshes[scene_instances[i].mesh_id];
+			const aabb& mesh_bounds = mesh.acceleration_structure.get_nodes().front().bounds;
+			for (int corner = 0; corner < 8; corner++)
+			{
+				const float3 point{
+						(corner & 1) ? mesh_bounds.aabb_max.x : mesh_bounds.aabb_min.x,
+						(corner & 2) ? mesh_bounds.aabb_max.y : mesh_bounds.aabb_min.y,
+						(corner & 4) ? mesh_bounds.aabb_max.z : mesh_bounds.aabb_min.z};
+				instance_bounds[i].add_point(mul(scene_instances[i].object_to_world, float4{point, 1.f}).xyz());
+			}
+		}
+		return instance_bounds;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::build_bottom_level(
+			bottom_level_structure<VB>& mesh,
+			const std::vector<std::shared_ptr<cg::resource<VB>>>& mesh_vertex_buffers,
+			const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& mesh_index_buffers,
+			const std::filesystem::path& mesh_cache_path)
+	{
+		// BVH с binned SAH по всем треугольникам сетки. Из кэша приходят узлы и порядок треугольников,
+		// сами треугольники всё равно читаются из буферов
+		const std::vector<aabb> primitive_bounds = read_triangles(mesh.triangles, mesh_vertex_buffers, mesh_index_buffers);
+		mesh.acceleration_structure.copy_settings(acceleration_structure);
+		if (mesh_cache_path.empty() || !mesh.acceleration_structure.load(mesh_cache_path, cache_key, primitive_bounds.size()))
+		{
+			mesh.acceleration_structure.build(primitive_bounds, get_triangle_vertices(mesh));
+			if (!mesh_cache_path.empty() && !mesh.acceleration_structure.save(mesh_cache_path, cache_key))
+				std::cout << "Could not write BVH cache " << mesh_cache_path << "\n";
+		}
+		order_triangles(mesh);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::refit_bottom_level(
+			bottom_level_structure<VB>& mesh,
+			const std::vector<std::shared_ptr<cg::resource<VB>>>& mesh_vertex_buffers,
+			const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& mesh_index_buffers)
+	{
+		const std::vector<aabb> primitive_bounds = read_triangles(mesh.triangles, mesh_vertex_buffers, mesh_index_buffers);
+		mesh.acceleration_structure.refit(primitive_bounds);
+		if (mesh.acceleration_structure.needs_rebuild())
+			mesh.acceleration_structure.build(primitive_bounds, get_triangle_vertices(mesh));
+		order_triangles(mesh);
+	}
+
+	template<typename VB, typename RT>
+	inline std::vector<aabb> raytracer<VB, RT>::read_triangles(
+			std::vector<triangle<VB>>& triangles,
+			const std::vector<std::shared_ptr<cg::resource<VB>>>& mesh_vertex_buffers,
+			const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& mesh_index_buffers)
+	{
+		triangles.clear();
+		for (size_t shape_id = 0; shape_id < mesh_index_buffers.size(); shape_id++)
+		{
+			auto& index_buffer = mesh_index_buffers[shape_id];
+			auto& vertex_buffer = mesh_vertex_buffers[shape_id];
+			for (size_t index_id = 0; index_id + 2 < index_buffer->count(); index_id += 3)
+			{
+				triangles.emplace_back(
+						vertex_buffer->item(index_buffer->item(index_id)),
+						vertex_buffer->item(index_buffer->item(index_id + 1)),
+						vertex_buffer->item(index_buffer->item(index_id + 2)));
+			}
+		}
+
+		std::vector<aabb> primitive_bounds(triangles.size());
+#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(triangles.size()); i++)
+		{
+			primitive_bounds[i].add_point(triangles[i].a);
+			primitive_bounds[i].add_point(triangles[i].b);
+			primitive_bounds[i].add_point(triangles[i].c);
+		}
+		return primitive_bounds;
+	}
+
+	template<typename VB, typename RT>
+	inline std::vector<float3> raytracer<VB, RT>::get_triangle_vertices(const bottom_level_structure<VB>& mesh)
+	{
+		std::vector<float3> vertices;
+		if (mesh.acceleration_structure.get_builder() != bvh_builder::sbvh)
+			return vertices;
+		vertices.resize(3 * mesh.triangles.size());
+#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(mesh.triangles.size()); i++)
+		{
+			vertices[3 * i] = mesh.triangles[i].a;
+			vertices[3 * i + 1] = mesh.triangles[i].b;
+			vertices[3 * i + 2] = mesh.triangles[i].c;
+		}
+		return vertices;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::order_triangles(bottom_level_structure<VB>& mesh)
+	{
+		// Перекладываем треугольники в порядке листьев: обход читает их подряд, без лишней косвенности
+		std::vector<triangle<VB>>& triangles = mesh.triangles;
+		std::vector<triangle<VB>> ordered_triangles;
+		ordered_triangles.reserve(triangles.size());
+		for (unsigned int primitive: mesh.acceleration_structure.get_primitive_indices())
+			ordered_triangles.push_back(triangles[primitive]);
+		triangles.swap(ordered_triangles);
+
+		// Пакеты идут подряд в том же порядке: треугольник i лежит в пакете i / TRIANGLE_PACKET_SIZE.
+		// Пустые слоты заполнены нулями, это вырожденные треугольники
+		std::vector<triangle_packet>& triangle_packets = mesh.triangle_packets;
+		triangle_packets.assign((triangles.size() + TRIANGLE_PACKET_SIZE - 1) / TRIANGLE_PACKET_SIZE, triangle_packet{});
+		for (size_t i = 0; i < triangles.size(); i++)
+		{
+			triangle_packet& packet = triangle_packets[i / TRIANGLE_PACKET_SIZE];
+			const size_t lane = i % TRIANGLE_PACKET_SIZE;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				packet.a[axis][lane] = triangles[i].a[axis];
+				packet.b[axis][lane] = triangles[i].b[axis];
+				packet.c[axis][lane] = triangles[i].c[axis];
+			}
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::print_acceleration_structure_statistics() const
+	{
+		for (size_t mesh_id = 0; mesh_id < meshes.size(); mesh_id++)
+		{
+			std::cout << "Mesh " << mesh_id << ": ";
+			meshes[mesh_id].acceleration_structure.print_statistics();
+		}
+		std::cout << "Top level over " << top_level_instances.size() << " instances" << (flat_scene ? " (skipped in traversal)" : "") << ": ";
+		acceleration_structure.print_statistics();
 	}
 
 	template<typename VB, typename RT>
@@ -167,6 +756,201 @@ namespace cg::renderer
 	{
 		// TODO Lab: 2.01 Implement `ray_generation` and `trace_ray` method of `raytracer` class
 		// TODO Lab: 2.06 Implement TAA in `ray_generation` method of `raytracer` class
+		const float aspect_ratio = static_cast<float>(width) / static_cast<float>(height);
+		sample_contexts.resize(static_cast<size_t>(omp_get_max_threads()));
+		scheduler.reset_statistics();
+		const std::vector<image_tile>& tiles = scheduler.get_tiles();
+
+		// Субпиксельный сдвиг зависит от пикселя и номера отсчёта: у разных плиток он свой
+		auto get_camera_ray = [&](size_t x, size_t y, uint32_t sample_index) {
+			const float2 jitter = get_jitter(uint2{static_cast<unsigned int>(x), static_cast<unsigned int>(y)}, sample_index);
+			float u = (2.f * (static_cast<float>(x) + jitter.x)) / static_cast<float>(width - 1) - 1.f;
+			float v = (2.f * (static_cast<float>(y) + jitter.y)) / static_cast<float>(height - 1) - 1.f;
+			u *= aspect_ratio;
+
+			float3 ray_direction = direction + u * right - v * up;
+			return ray(position, ray_direction);
+		};
+		// Плитка делится на блоки RAY_PACKET_TILE_SIZE x RAY_PACKET_TILE_SIZE: их первичные лучи
+		// почти параллельны и обходят BVH одним пакетом
+		auto for_each_block = [&](const image_tile& tile, uint32_t sample_index, auto&& visit_block) {
+			std::array<ray, BVH_PACKET_SIZE> rays;
+			std::array<uint2, BVH_PACKET_SIZE> pixels;
+			for (size_t block_y = tile.y; block_y < tile.y + tile.height; block_y += RAY_PACKET_TILE_SIZE)
+			{
+				for (size_t block_x = tile.x; block_x < tile.x + tile.width; block_x += RAY_PACKET_TILE_SIZE)
+				{
+					size_t count = 0;
+					for (size_t y = block_y; y < std::min(block_y + RAY_PACKET_TILE_SIZE, tile.y + tile.height); y++)
+					{
+						for (size_t x = block_x; x < std::min(block_x + RAY_PACKET_TILE_SIZE, tile.x + tile.width); x++)
+						{
+							rays[count] = get_camera_ray(x, y, sample_index);
+							pixels[count] = uint2{static_cast<unsigned int>(x), static_cast<unsigned int>(y)};
+							count++;
+						}
+					}
+					visit_block(rays.data(), pixels.data(), count);
+				}
+			}
+		};
+
+		// Без адаптивности каждая плитка получает ровно accumulation_num отсчётов. С ней — не меньше
+		// min_samples, а остаток того же бюджета уходит плиткам, где ошибка среднего выше порога.
+		// С ограничением по времени бюджет — число отсчётов, которое успеет до срока по скорости прошлого прохода
+		const bool adaptive = adaptive_threshold > 0.f;
+		const bool time_limited = time_budget_ms > 0.f;
+		const size_t min_samples = adaptive ? std::min(accumulation_num, ADAPTIVE_MIN_SAMPLES) : (time_limited ? 1 : accumulation_num);
+		const size_t max_samples = time_limited ? std::numeric_limits<size_t>::max() : (adaptive ? ADAPTIVE_MAX_SAMPLES_SCALE * accumulation_num : accumulation_num);
+		size_t remaining_budget = time_limited ? std::numeric_limits<size_t>::max() : accumulation_num * width * height;
+		const auto start = std::chrono::high_resolution_clock::now();
+		std::vector<size_t> tile_samples(tiles.size(), 0);
+		std::vector<float> tile_errors(tiles.size(), std::numeric_limits<float>::max());
+		std::vector<size_t> active_tiles(tiles.size());
+		std::iota(active_tiles.begin(), active_tiles.end(), size_t{0});
+		size_t primary_rays = 0;
+		size_t path_segments = 0;
+
+		// Ошибка плитки — наибольшая относительная ошибка среднего среди её пикселей
+		auto accumulate_tile = [&](size_t tile_id, auto&& get_color) {
+			const image_tile& tile = tiles[tile_id];
+			float tile_error = 0.f;
+			for (size_t y = tile.y; y < tile.y + tile.height; y++)
+			{
+				for (size_t x = tile.x; x < tile.x + tile.width; x++)
+				{
+					pixel_statistics& history_pixel = history->item(x, y);
+					history_pixel.add_sample(get_color(x, y));
+					tile_error = std::max(tile_error, history_pixel.get_relative_error());
+				}
+			}
+			tile_samples[tile_id]++;
+			tile_errors[tile_id] = tile_error;
+		};
+
+		size_t pass = 0;
+		for (; !active_tiles.empty(); pass++)
+		{
+			const auto pass_start = std::chrono::high_resolution_clock::now();
+			if (depth > 1 && scatter_shader)
+			{
+				// Пути идут волновым фронтом: лучи одного отскока всех пикселей собираются в поток,
+				// сортируются и обходят BVH пачками — узлы и треугольники остаются в кэше
+				std::vector<float3> radiance(width * height, float3{0.f, 0.f, 0.f});
+				std::vector<stream_ray> stream;
+				for (size_t tile_id: active_tiles)
+				{
+					const uint32_t sample_index = static_cast<uint32_t>(tile_samples[tile_id]);
+					for_each_block(tiles[tile_id], sample_index, [&](const ray* rays, const uint2* pixels, size_t count) {
+						for (size_t i = 0; i < count; i++)
+							stream.push_back({rays[i], float3{1.f, 1.f, 1.f}, static_cast<unsigned int>(pixels[i].y * width + pixels[i].x), sample_index, 0.f});
+					});
+				}
+
+				primary_rays += stream.size();
+				for (size_t bounce = 0; bounce < depth && !stream.empty(); bounce++)
+				{
+					path_segments += stream.size();
+					// Первичные лучи уже идут плитками, а отражённые разлетаются и требуют сортировки
+					if (bounce > 0)
+						sort_stream(stream);
+					trace_stream(stream, depth - bounce, bounce == 0 && packet_tracing, radiance, bounce);
+				}
+
+				scheduler.run(active_tiles.size(), [&](size_t item, size_t) {
+					accumulate_tile(active_tiles[item], [&](size_t x, size_t y) { return radiance[y * width + x]; });
+				});
+			}
+			else
+			{
+				scheduler.run(active_tiles.size(), [&](size_t item, size_t thread_id) {
+					const size_t tile_id = active_tiles[item];
+					const uint32_t sample_index = static_cast<uint32_t>(tile_samples[tile_id]);
+					std::vector<float3> colors(tiles[tile_id].width * tiles[tile_id].height);
+					for_each_block(tiles[tile_id], sample_index, [&](const ray* rays, const uint2* pixels, size_t count) {
+						std::array<payload, BVH_PACKET_SIZE> payloads;
+						// Отсчёты зависят только от пикселя и номера отсчёта, а не от потока:
+						// изображение не зависит от того, кто украл плитку
+						if (packet_tracing)
+						{
+							for (size_t i = 0; i < count; i++)
+								begin_path_sample(thread_id, i, pixels[i], sample_index, 0);
+							trace_ray_packet(rays, count, depth, payloads.data());
+						}
+						else
+						{
+							for (size_t i = 0; i < count; i++)
+							{
+								begin_path_sample(thread_id, 0, pixels[i], sample_index, 0);
+								payloads[i] = trace_ray(rays[i], depth);
+							}
+						}
+						for (size_t i = 0; i < count; i++)
+							colors[(pixels[i].y - tiles[tile_id].y) * tiles[tile_id].width + pixels[i].x - tiles[tile_id].x] = payloads[i].color.to_float3();
+					});
+					accumulate_tile(tile_id, [&](size_t x, size_t y) { return colors[(y - tiles[tile_id].y) * tiles[tile_id].width + x - tiles[tile_id].x]; });
+				});
+			}
+
+			size_t pass_samples = 0;
+			for (size_t tile_id: active_tiles)
+				pass_samples += tiles[tile_id].width * tiles[tile_id].height;
+			if (time_limited)
+			{
+				using duration = std::chrono::duration<float, std::milli>;
+				const auto now = std::chrono::high_resolution_clock::now();
+				const float sample_ms = duration(now - pass_start).count() / static_cast<float>(pass_samples);
+				const float remaining_ms = time_budget_ms - duration(now - start).count();
+				remaining_budget = remaining_ms > 0.f && sample_ms > 0.f ? static_cast<size_t>(remaining_ms / sample_ms) : 0;
+			}
+			else
+				remaining_budget -= std::min(remaining_budget, pass_samples);
+
+			// Следующий проход: сначала самые шумные плитки, пока хватает бюджета
+			std::vector<size_t> next_tiles;
+			for (size_t tile_id = 0; tile_id < tiles.size(); tile_id++)
+			{
+				if (tile_samples[tile_id] < min_samples ||
+					(tile_samples[tile_id] < max_samples && (!adaptive || tile_errors[tile_id] > adaptive_threshold)))
+					next_tiles.push_back(tile_id);
+			}
+			std::stable_sort(next_tiles.begin(), next_tiles.end(), [&](size_t a, size_t b) { return tile_errors[a] > tile_errors[b]; });
+			active_tiles.clear();
+			size_t planned_samples = 0;
+			for (size_t tile_id: next_tiles)
+			{
+				const size_t tile_pixels = tiles[tile_id].width * tiles[tile_id].height;
+				// Срок важнее минимального числа отсчётов
+				if ((time_limited || tile_samples[tile_id] >= min_samples) && planned_samples + tile_pixels > remaining_budget)
+					continue;
+				active_tiles.push_back(tile_id);
+				planned_samples += tile_pixels;
+			}
+		}
+
+		sampling_statistics = {};
+		sampling_statistics.adaptive = adaptive;
+		sampling_statistics.pass_count = pass;
+		sampling_statistics.min_samples = std::numeric_limits<size_t>::max();
+		size_t total_samples = 0;
+		for (size_t tile_id = 0; tile_id < tiles.size(); tile_id++)
+		{
+			total_samples += tile_samples[tile_id] * tiles[tile_id].width * tiles[tile_id].height;
+			sampling_statistics.min_samples = std::min(sampling_statistics.min_samples, tile_samples[tile_id]);
+			sampling_statistics.max_samples = std::max(sampling_statistics.max_samples, tile_samples[tile_id]);
+			if (tile_errors[tile_id] <= adaptive_threshold)
+				sampling_statistics.converged_tiles++;
+		}
+		sampling_statistics.average_samples = static_cast<float>(total_samples) / static_cast<float>(width * height);
+		if (primary_rays > 0)
+			sampling_statistics.average_path_length = static_cast<float>(path_segments) / static_cast<float>(primary_rays);
+
+		scheduler.run(tiles.size(), [&](size_t tile_id, size_t) {
+			const image_tile& tile = tiles[tile_id];
+			for (size_t y = tile.y; y < tile.y + tile.height; y++)
+				for (size_t x = tile.x; x < tile.x + tile.width; x++)
+					render_target->item(x, y) = RT::from_float3(history->item(x, y).mean);
+		});
 	}
 
 	template<typename VB, typename RT>
@@ -177,7 +961,463 @@ namespace cg::renderer
 		// TODO Lab: 2.02 Adjust `trace_ray` method of `raytracer` class to traverse geometry and call a closest hit shader
 		// TODO Lab: 2.04 Adjust `trace_ray` method of `raytracer` to use `any_hit_shader`
 		// TODO Lab: 2.05 Adjust `trace_ray` method of `raytracer` class to traverse the acceleration structure
-		return payload{};
+		if (depth == 0)
+			return miss_shader(ray);
+		depth--;
+
+		const triangle<VB>* closest_triangle = nullptr;
+		// any_hit_shader достаточно первого найденного пересечения
+		payload closest_hit_payload = closest_hit(ray, closest_triangle, any_hit_shader != nullptr, max_t, min_t);
+		triangle<VB> world_triangle;
+		closest_triangle = get_world_triangle(closest_triangle, closest_hit_payload, world_triangle);
+		if (closest_triangle)
+		{
+			if (any_hit_shader)
+				return any_hit_shader(ray, closest_hit_payload, *closest_triangle);
+			if (closest_hit_shader)
+				return closest_hit_shader(ray, closest_hit_payload, *closest_triangle, depth);
+		}
+		return miss_shader(ray);
+	}
+
+	template<typename VB, typename RT>
+	inline payload raytracer<VB, RT>::closest_hit(
+			const ray& ray, const triangle<VB>*& hit_triangle, bool first_hit, float max_t, float min_t) const
+	{
+		payload closest_hit_payload{};
+		closest_hit_payload.t = max_t;
+		hit_triangle = nullptr;
+
+		traverse_instances(ray, max_t, [&](size_t instance_id, const bottom_level_structure<VB>& mesh, const cg::renderer::ray& object_ray, float& instance_max_t) {
+			const ray_shear shear(object_ray);
+			bool stop = false;
+			mesh.acceleration_structure.traverse(
+					object_ray.position, object_ray.direction, instance_max_t,
+					[&](unsigned int first, unsigned int count, float& current_max_t) {
+						size_t primitive = 0;
+						const payload payload = intersect_leaf(mesh, first, count, object_ray, shear, min_t, closest_hit_payload.t, primitive);
+						if (payload.t <= 0.f)
+							return false;
+						closest_hit_payload = payload;
+						closest_hit_payload.instance_id = static_cast<unsigned int>(instance_id);
+						closest_hit_payload.primitive_id = static_cast<unsigned int>(primitive);
+						hit_triangle = &mesh.triangles[primitive];
+						current_max_t = payload.t;
+						instance_max_t = payload.t;
+						stop = first_hit;
+						return first_hit;
+					});
+			return stop;
+		});
+		return closest_hit_payload;
+	}
+
+	template<typename VB, typename RT>
+	template<typename F>
+	inline void raytracer<VB, RT>::traverse_instances(const ray& ray, float max_t, F&& visit_mesh) const
+	{
+		if (flat_scene)
+		{
+			visit_mesh(0, meshes[0], ray, max_t);
+			return;
+		}
+		acceleration_structure.traverse(
+				ray.position, ray.direction, max_t,
+				[&](unsigned int first, unsigned int count, float& current_max_t) {
+					for (unsigned int instance_id = first; instance_id < first + count; instance_id++)
+					{
+						const mesh_instance& instance = top_level_instances[instance_id];
+						if (visit_mesh(instance_id, meshes[instance.mesh_id], transform_ray(instance.world_to_object, ray), current_max_t))
+							return true;
+					}
+					return false;
+				});
+	}
+
+	template<typename VB, typename RT>
+	template<typename F>
+	inline void raytracer<VB, RT>::traverse_instances_packet(bvh_ray_packet& packet, const ray* rays, F&& visit_mesh) const
+	{
+		if (flat_scene)
+		{
+			visit_mesh(0, meshes[0], packet, rays, BVH_ALL_RAYS);
+			return;
+		}
+		acceleration_structure.traverse_packet(
+				packet,
+				[&](unsigned int first, unsigned int count, bvh_ray_packet& packet, bvh_ray_mask active_rays) {
+					for (unsigned int instance_id = first; instance_id < first + count; instance_id++)
+					{
+						// Общее начало лучей остаётся общим и в координатах сетки, так что пакет не распадается
+						const mesh_instance& instance = top_level_instances[instance_id];
+						bvh_ray_packet object_packet;
+						std::array<ray, BVH_PACKET_SIZE> object_rays;
+						object_packet.position = mul(instance.world_to_object, float4{packet.position, 1.f}).xyz();
+						object_packet.size = packet.size;
+						for (size_t i = 0; i < packet.size; i++)
+						{
+							object_rays[i] = transform_ray(instance.world_to_object, rays[i]);
+							object_packet.directions[i] = object_rays[i].direction;
+							object_packet.max_t[i] = packet.max_t[i];
+						}
+						const bool stop = visit_mesh(instance_id, meshes[instance.mesh_id], object_packet, object_rays.data(), active_rays);
+						for (size_t i = 0; i < packet.size; i++)
+						{
+							if (active_rays >> i & 1)
+								packet.max_t[i] = object_packet.max_t[i];
+						}
+						if (stop)
+							return true;
+					}
+					return false;
+				});
+	}
+
+	template<typename VB, typename RT>
+	inline payload raytracer<VB, RT>::intersect_leaf(
+			const bottom_level_structure<VB>& mesh, unsigned int first, unsigned int count, const ray& ray, const ray_shear& shear, float min_t, float max_t, size_t& primitive) const
+	{
+		// Лист может начинаться и заканчиваться посреди пакета: лишние слоты отсекаются маской
+		payload closest_payload{};
+		closest_payload.t = -1.f;
+		for (size_t packet_id = first / TRIANGLE_PACKET_SIZE; packet_id * TRIANGLE_PACKET_SIZE < first + count; packet_id++)
+		{
+			size_t lane;
+			const payload payload = intersect_triangle_packet(mesh, packet_id, ray, shear, get_lane_mask(packet_id, first, count), min_t, max_t, lane);
+			if (payload.t > 0.f)
+			{
+				closest_payload = payload;
+				primitive = packet_id * TRIANGLE_PACKET_SIZE + lane;
+				max_t = payload.t;
+			}
+		}
+		return closest_payload;
+	}
+
+	template<typename VB, typename RT>
+	inline const triangle<VB>* raytracer<VB, RT>::get_world_triangle(
+			const triangle<VB>* hit_triangle, const payload& payload, triangle<VB>& storage) const
+	{
+		if (!hit_triangle || flat_scene)
+			return hit_triangle;
+		// Нормали переводятся транспонированной обратной матрицей, чтобы остаться перпендикулярными при неравномерном масштабе
+		const mesh_instance& instance = top_level_instances[payload.instance_id];
+		const float4x4 normal_transform = transpose(instance.world_to_object);
+		storage = *hit_triangle;
+		storage.a = mul(instance.object_to_world, float4{hit_triangle->a, 1.f}).xyz();
+		storage.b = mul(instance.object_to_world, float4{hit_triangle->b, 1.f}).xyz();
+		storage.c = mul(instance.object_to_world, float4{hit_triangle->c, 1.f}).xyz();
+		storage.ba = storage.b - storage.a;
+		storage.ca = storage.c - storage.a;
+		storage.na = mul(normal_transform, float4{hit_triangle->na, 0.f}).xyz();
+		storage.nb = mul(normal_transform, float4{hit_triangle->nb, 0.f}).xyz();
+		storage.nc = mul(normal_transform, float4{hit_triangle->nc, 0.f}).xyz();
+		return &storage;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::trace_ray_packet(const ray* rays, size_t count, size_t depth, payload* payloads) const
+	{
+		// any_hit_shader предполагает обход одиночными лучами
+		if (depth == 0 || any_hit_shader)
+		{
+			for (size_t i = 0; i < count; i++)
+				payloads[i] = trace_ray(rays[i], depth);
+			return;
+		}
+		depth--;
+
+		std::array<const triangle<VB>*, BVH_PACKET_SIZE> hit_triangles;
+		std::array<triangle<VB>, BVH_PACKET_SIZE> world_triangles;
+		closest_hit_packet(rays, count, payloads, hit_triangles.data());
+		for (size_t i = 0; i < count; i++)
+			hit_triangles[i] = get_world_triangle(hit_triangles[i], payloads[i], world_triangles[i]);
+		shade_packet(rays, count, depth, payloads, hit_triangles.data());
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::shade_packet(
+			const ray* rays, size_t count, size_t depth, payload* payloads, const triangle<VB>* const* hit_triangles) const
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!hit_triangles[i])
+				payloads[i] = miss_shader(rays[i]);
+		}
+
+		if (closest_hit_packet_shader)
+		{
+			closest_hit_packet_shader(rays, payloads, hit_triangles, count, depth);
+			return;
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			if (hit_triangles[i] && closest_hit_shader)
+				payloads[i] = closest_hit_shader(rays[i], payloads[i], *hit_triangles[i], depth);
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::trace_stream(
+			std::vector<stream_ray>& stream, size_t depth, bool packets, std::vector<float3>& radiance, size_t bounce)
+	{
+		depth--;
+		std::vector<stream_ray> scattered(stream.size());
+		std::vector<char> scattered_mask(stream.size(), 0);
+		const size_t batch_count = (stream.size() + BVH_PACKET_SIZE - 1) / BVH_PACKET_SIZE;
+		// У каждого пикселя в потоке не больше одного луча, поэтому radiance пишется без синхронизации
+		scheduler.run(batch_count, [&](size_t batch, size_t thread_id) {
+			const size_t first = batch * BVH_PACKET_SIZE;
+			const size_t count = std::min(BVH_PACKET_SIZE, stream.size() - first);
+			std::array<ray, BVH_PACKET_SIZE> rays;
+			std::array<payload, BVH_PACKET_SIZE> hits;
+			std::array<const triangle<VB>*, BVH_PACKET_SIZE> hit_triangles;
+			for (size_t i = 0; i < count; i++)
+				rays[i] = stream[first + i].segment;
+
+			// Пакетом идут только первичные лучи: у них общее начало
+			if (packets)
+				closest_hit_packet(rays.data(), count, hits.data(), hit_triangles.data());
+			else
+			{
+				for (size_t i = 0; i < count; i++)
+					hits[i] = closest_hit(rays[i], hit_triangles[i]);
+			}
+			std::array<triangle<VB>, BVH_PACKET_SIZE> world_triangles;
+			for (size_t i = 0; i < count; i++)
+				hit_triangles[i] = get_world_triangle(hit_triangles[i], hits[i], world_triangles[i]);
+
+			// Шейдеры перезаписывают payload, а scatter_shader нужны исходные t и барицентрические координаты
+			std::array<payload, BVH_PACKET_SIZE> payloads = hits;
+			for (size_t i = 0; i < count; i++)
+			{
+				const stream_ray& path = stream[first + i];
+				begin_path_sample(thread_id, i, uint2{static_cast<unsigned int>(path.pixel_id % width), static_cast<unsigned int>(path.pixel_id / width)}, path.sample_index, bounce, path.scatter_pdf);
+			}
+			if (closest_hit_packet_shader)
+				shade_packet(rays.data(), count, depth, payloads.data(), hit_triangles.data());
+
+			for (size_t i = 0; i < count; i++)
+			{
+				const stream_ray& path = stream[first + i];
+				select_path(thread_id, i);
+				if (!closest_hit_packet_shader)
+					shade_packet(&rays[i], 1, depth, &payloads[i], &hit_triangles[i]);
+				radiance[path.pixel_id] += path.throughput * payloads[i].color.to_float3();
+
+				float3 attenuation;
+				float pdf = 0.f;
+				if (depth > 0 && hit_triangles[i] &&
+					scatter_shader(rays[i], hits[i], *hit_triangles[i], scattered[first + i].segment, attenuation, pdf))
+				{
+					float3 throughput = path.throughput * attenuation;
+					// Русская рулетка: путь выживает с вероятностью по пропускной способности,
+					// а вклад выжившего делится на неё — среднее не смещается
+					if (russian_roulette_depth > 0 && bounce + 1 >= russian_roulette_depth)
+					{
+						const float survival = std::min(maxelem(throughput), RUSSIAN_ROULETTE_MAX_SURVIVAL);
+						if (!(get_sample_2d().x < survival))
+							continue;
+						throughput /= survival;
+					}
+					scattered[first + i].throughput = throughput;
+					scattered[first + i].pixel_id = path.pixel_id;
+					scattered[first + i].sample_index = path.sample_index;
+					scattered[first + i].scatter_pdf = pdf;
+					scattered_mask[first + i] = 1;
+				}
+			}
+		});
+
+		stream.clear();
+		for (size_t i = 0; i < scattered.size(); i++)
+		{
+			if (scattered_mask[i])
+				stream.push_back(scattered[i]);
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::sort_stream(std::vector<stream_ray>& stream) const
+	{
+		// Рядом оказываются лучи с близким началом и направлением одного октанта:
+		// они обходят одни и те же узлы BVH и проверяют одни и те же треугольники
+		if (acceleration_structure.get_nodes().empty())
+			return;
+		const aabb& scene_bounds = acceleration_structure.get_nodes().front().bounds;
+		std::vector<unsigned int> keys(stream.size());
+		std::vector<unsigned int> order(stream.size());
+#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(stream.size()); i++)
+		{
+			const ray& ray = stream[static_cast<size_t>(i)].segment;
+			const unsigned int octant = (ray.direction.x < 0.f ? 1u : 0u) |
+										(ray.direction.y < 0.f ? 2u : 0u) |
+										(ray.direction.z < 0.f ? 4u : 0u);
+			keys[static_cast<size_t>(i)] = (octant << STREAM_OCTANT_SHIFT) |
+										   (bvh::get_morton_code(ray.position, scene_bounds) >> 3);
+			order[static_cast<size_t>(i)] = static_cast<unsigned int>(i);
+		}
+		bvh::radix_sort(keys, order);
+
+		std::vector<stream_ray> sorted_stream(stream.size());
+#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(stream.size()); i++)
+			sorted_stream[static_cast<size_t>(i)] = stream[order[static_cast<size_t>(i)]];
+		stream.swap(sorted_stream);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::closest_hit_packet(
+			const ray* rays, size_t count, payload* payloads, const triangle<VB>** hit_triangles, float max_t, float min_t) const
+	{
+		// Двоичная BVH пакетов не поддерживает: лучи идут по одному
+		if (!acceleration_structure.supports_packets())
+		{
+			for (size_t i = 0; i < count; i++)
+				payloads[i] = closest_hit(rays[i], hit_triangles[i], false, max_t, min_t);
+			return;
+		}
+
+		bvh_ray_packet packet;
+		packet.position = rays[0].position;
+		packet.size = count;
+		for (size_t i = 0; i < count; i++)
+		{
+			payloads[i] = payload{};
+			payloads[i].t = max_t;
+			hit_triangles[i] = nullptr;
+			packet.directions[i] = rays[i].direction;
+			packet.max_t[i] = max_t;
+		}
+
+		traverse_instances_packet(packet, rays, [&](size_t instance_id, const bottom_level_structure<VB>& mesh, bvh_ray_packet& object_packet, const ray* object_rays, bvh_ray_mask instance_rays) {
+			std::array<ray_shear, BVH_PACKET_SIZE> shears;
+			for (size_t i = 0; i < object_packet.size; i++)
+				shears[i] = ray_shear(object_rays[i]);
+			mesh.acceleration_structure.traverse_packet(
+					object_packet,
+					[&](unsigned int first, unsigned int primitive_count, bvh_ray_packet& object_packet, bvh_ray_mask active_rays) {
+						for (size_t packet_id = first / TRIANGLE_PACKET_SIZE; packet_id * TRIANGLE_PACKET_SIZE < first + primitive_count; packet_id++)
+						{
+							const int lane_mask = get_lane_mask(packet_id, first, primitive_count);
+							for (size_t i = 0; i < object_packet.size; i++)
+							{
+								if (!(active_rays >> i & 1))
+									continue;
+								size_t lane;
+								const payload payload = intersect_triangle_packet(mesh, packet_id, object_rays[i], shears[i], lane_mask, min_t, object_packet.max_t[i], lane);
+								if (payload.t > 0.f)
+								{
+									payloads[i] = payload;
+									payloads[i].instance_id = static_cast<unsigned int>(instance_id);
+									payloads[i].primitive_id = static_cast<unsigned int>(packet_id * TRIANGLE_PACKET_SIZE + lane);
+									hit_triangles[i] = &mesh.triangles[packet_id * TRIANGLE_PACKET_SIZE + lane];
+									object_packet.max_t[i] = payload.t;
+								}
+							}
+						}
+						return false;
+					},
+					instance_rays);
+			return false;
+		});
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::occluded_packet(
+			const float3& origin, const float3* targets, size_t count, bool* result, float min_t) const
+	{
+		// Лучи идут от источника к точкам: начало у пакета общее, у каждой точки свой предел
+		std::array<ray, BVH_PACKET_SIZE> rays;
+		bvh_ray_packet packet;
+		packet.position = origin;
+		packet.size = count;
+		for (size_t i = 0; i < count; i++)
+		{
+			rays[i] = ray(origin, targets[i] - origin);
+			packet.directions[i] = rays[i].direction;
+			packet.max_t[i] = length(targets[i] - origin) - min_t;
+			result[i] = false;
+		}
+
+		if (!acceleration_structure.supports_packets())
+		{
+			for (size_t i = 0; i < count; i++)
+				result[i] = occluded(rays[i], packet.max_t[i], min_t);
+			return;
+		}
+
+		size_t remaining = count;
+		traverse_instances_packet(packet, rays.data(), [&](size_t, const bottom_level_structure<VB>& mesh, bvh_ray_packet& object_packet, const ray* object_rays, bvh_ray_mask instance_rays) {
+			std::array<ray_shear, BVH_PACKET_SIZE> shears;
+			for (size_t i = 0; i < object_packet.size; i++)
+				shears[i] = ray_shear(object_rays[i]);
+			bool done = false;
+			mesh.acceleration_structure.traverse_packet(
+					object_packet,
+					[&](unsigned int first, unsigned int primitive_count, bvh_ray_packet& object_packet, bvh_ray_mask active_rays) {
+						for (size_t packet_id = first / TRIANGLE_PACKET_SIZE; packet_id * TRIANGLE_PACKET_SIZE < first + primitive_count; packet_id++)
+						{
+							const int lane_mask = get_lane_mask(packet_id, first, primitive_count);
+							for (size_t i = 0; i < object_packet.size; i++)
+							{
+								// Затенённый уже в этом листе луч выключен через max_t
+								if (!(active_rays >> i & 1) || object_packet.max_t[i] < 0.f)
+									continue;
+								size_t lane;
+								const payload payload = intersect_triangle_packet(mesh, packet_id, object_rays[i], shears[i], lane_mask, min_t, object_packet.max_t[i], lane);
+								if (payload.t > 0.f)
+								{
+									// Затенённый луч выключается из обхода
+									result[i] = true;
+									object_packet.max_t[i] = -1.f;
+									if (--remaining == 0)
+									{
+										done = true;
+										return true;
+									}
+								}
+							}
+						}
+						return false;
+					},
+					instance_rays);
+			return done;
+		});
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_packet_tracing(bool in_packet_tracing)
+	{
+		packet_tracing = in_packet_tracing;
+	}
+
+	template<typename VB, typename RT>
+	inline payload raytracer<VB, RT>::intersect_triangle_packet(
+			const bottom_level_structure<VB>& mesh, size_t packet_id, const ray& ray, const ray_shear& shear, int lane_mask, float min_t, float max_t, size_t& lane) const
+	{
+		if (watertight)
+			return watertight_intersection_shader(mesh.triangle_packets[packet_id], ray, shear, lane_mask, min_t, max_t, lane);
+		return intersection_shader(mesh.triangle_packets[packet_id], ray, lane_mask, min_t, max_t, lane);
+	}
+
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::occluded(const ray& ray, float max_t, float min_t) const
+	{
+		bool hit = false;
+		traverse_instances(ray, max_t, [&](size_t, const bottom_level_structure<VB>& mesh, const cg::renderer::ray& object_ray, float&) {
+			const ray_shear shear(object_ray);
+			mesh.acceleration_structure.traverse(
+					object_ray.position, object_ray.direction, max_t,
+					[&](unsigned int first, unsigned int count, float&) {
+						size_t primitive = 0;
+						hit = intersect_leaf(mesh, first, count, object_ray, shear, min_t, max_t, primitive).t > 0.f;
+						return hit;
+					});
+			return hit;
+		});
+		return hit;
 	}
 
 	template<typename VB, typename RT>
@@ -185,32 +1425,275 @@ namespace cg::renderer
 			const triangle<VB>& triangle, const ray& ray) const
 	{
 		// TODO Lab: 2.02 Implement an `intersection_shader` method of `raytracer` class
-		return payload{};
+		// Möller–Trumbore
+		payload payload{};
+		payload.t = -1.f;
+
+		const float3 pvec = cross(ray.direction, triangle.ca);
+		const float det = dot(triangle.ba, pvec);
+		if (det > -1e-8f && det < 1e-8f)
+			return payload;
+
+		const float inv_det = 1.f / det;
+		const float3 tvec = ray.position - triangle.a;
+		const float u = dot(tvec, pvec) * inv_det;
+		if (u < 0.f || u > 1.f)
+			return payload;
+
+		const float3 qvec = cross(tvec, triangle.ba);
+		const float v = dot(ray.direction, qvec) * inv_det;
+		if (v < 0.f || u + v > 1.f)
+			return payload;
+
+		payload.t = dot(triangle.ca, qvec) * inv_det;
+		payload.bary = float3{1.f - u - v, u, v};
+		return payload;
 	}
 
 	template<typename VB, typename RT>
-	float2 raytracer<VB, RT>::get_jitter(int frame_id)
+	inline payload raytracer<VB, RT>::intersection_shader(
+			const triangle_packet& packet, const ray& ray, int lane_mask, float min_t, float max_t, size_t& lane) const
 	{
-		// TODO Lab: 2.06 Implement `get_jitter` method of `raytracer` class
+		alignas(16) float t[TRIANGLE_PACKET_SIZE];
+		alignas(16) float u[TRIANGLE_PACKET_SIZE];
+		alignas(16) float v[TRIANGLE_PACKET_SIZE];
+#ifdef CG_SSE
+		const __m128 direction_x = _mm_set1_ps(ray.direction.x);
+		const __m128 direction_y = _mm_set1_ps(ray.direction.y);
+		const __m128 direction_z = _mm_set1_ps(ray.direction.z);
+		const __m128 a_x = _mm_load_ps(packet.a[0]);
+		const __m128 a_y = _mm_load_ps(packet.a[1]);
+		const __m128 a_z = _mm_load_ps(packet.a[2]);
+		const __m128 ba_x = _mm_sub_ps(_mm_load_ps(packet.b[0]), a_x);
+		const __m128 ba_y = _mm_sub_ps(_mm_load_ps(packet.b[1]), a_y);
+		const __m128 ba_z = _mm_sub_ps(_mm_load_ps(packet.b[2]), a_z);
+		const __m128 ca_x = _mm_sub_ps(_mm_load_ps(packet.c[0]), a_x);
+		const __m128 ca_y = _mm_sub_ps(_mm_load_ps(packet.c[1]), a_y);
+		const __m128 ca_z = _mm_sub_ps(_mm_load_ps(packet.c[2]), a_z);
+
+		// pvec = direction x ca
+		const __m128 pvec_x = _mm_sub_ps(_mm_mul_ps(direction_y, ca_z), _mm_mul_ps(direction_z, ca_y));
+		const __m128 pvec_y = _mm_sub_ps(_mm_mul_ps(direction_z, ca_x), _mm_mul_ps(direction_x, ca_z));
+		const __m128 pvec_z = _mm_sub_ps(_mm_mul_ps(direction_x, ca_y), _mm_mul_ps(direction_y, ca_x));
+		const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ba_x, pvec_x), _mm_mul_ps(ba_y, pvec_y)), _mm_mul_ps(ba_z, pvec_z));
+		const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+		const __m128 tvec_x = _mm_sub_ps(_mm_set1_ps(ray.position.x), a_x);
+		const __m128 tvec_y = _mm_sub_ps(_mm_set1_ps(ray.position.y), a_y);
+		const __m128 tvec_z = _mm_sub_ps(_mm_set1_ps(ray.position.z), a_z);
+		const __m128 u_4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tvec_x, pvec_x), _mm_mul_ps(tvec_y, pvec_y)), _mm_mul_ps(tvec_z, pvec_z)), inv_det);
+
+		// qvec = tvec x ba
+		const __m128 qvec_x = _mm_sub_ps(_mm_mul_ps(tvec_y, ba_z), _mm_mul_ps(tvec_z, ba_y));
+		const __m128 qvec_y = _mm_sub_ps(_mm_mul_ps(tvec_z, ba_x), _mm_mul_ps(tvec_x, ba_z));
+		const __m128 qvec_z = _mm_sub_ps(_mm_mul_ps(tvec_x, ba_y), _mm_mul_ps(tvec_y, ba_x));
+		const __m128 v_4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(direction_x, qvec_x), _mm_mul_ps(direction_y, qvec_y)), _mm_mul_ps(direction_z, qvec_z)), inv_det);
+		const __m128 t_4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ca_x, qvec_x), _mm_mul_ps(ca_y, qvec_y)), _mm_mul_ps(ca_z, qvec_z)), inv_det);
+
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+		__m128 hit = _mm_cmpge_ps(abs_det, _mm_set1_ps(1e-8f));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(u_4, zero));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(v_4, zero));
+		hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u_4, v_4), _mm_set1_ps(1.f)));
+		hit = _mm_and_ps(hit, _mm_cmpgt_ps(t_4, _mm_set1_ps(min_t)));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(t_4, _mm_set1_ps(max_t)));
+		const int hit_mask = _mm_movemask_ps(hit) & lane_mask;
+		_mm_store_ps(t, t_4);
+		_mm_store_ps(u, u_4);
+		_mm_store_ps(v, v_4);
+#else
+		int hit_mask = 0;
+		for (size_t i = 0; i < TRIANGLE_PACKET_SIZE; i++)
+		{
+			if (!(lane_mask & (1 << i)))
+				continue;
+			const float3 a{packet.a[0][i], packet.a[1][i], packet.a[2][i]};
+			const float3 ba = float3{packet.b[0][i], packet.b[1][i], packet.b[2][i]} - a;
+			const float3 ca = float3{packet.c[0][i], packet.c[1][i], packet.c[2][i]} - a;
+			const float3 pvec = cross(ray.direction, ca);
+			const float det = dot(ba, pvec);
+			if (det > -1e-8f && det < 1e-8f)
+				continue;
+
+			const float inv_det = 1.f / det;
+			const float3 tvec = ray.position - a;
+			const float3 qvec = cross(tvec, ba);
+			u[i] = dot(tvec, pvec) * inv_det;
+			v[i] = dot(ray.direction, qvec) * inv_det;
+			t[i] = dot(ca, qvec) * inv_det;
+			if (u[i] >= 0.f && v[i] >= 0.f && u[i] + v[i] <= 1.f && t[i] > min_t && t[i] < max_t)
+				hit_mask |= 1 << i;
+		}
+#endif
+		return get_closest_lane(hit_mask, t, u, v, lane);
 	}
 
+	template<typename VB, typename RT>
+	inline payload raytracer<VB, RT>::watertight_intersection_shader(
+			const triangle_packet& packet, const ray& ray, const ray_shear& shear, int lane_mask, float min_t, float max_t, size_t& lane) const
+	{
+		// Переводим вершины в систему луча; рёбра-функции U, V, W одинаково вычисляются
+		// для общего ребра соседних треугольников, поэтому точка на ребре попадает хотя бы в один из них
+		alignas(16) float edge_u[TRIANGLE_PACKET_SIZE];
+		alignas(16) float edge_v[TRIANGLE_PACKET_SIZE];
+		alignas(16) float edge_w[TRIANGLE_PACKET_SIZE];
+		alignas(16) float scaled_t[TRIANGLE_PACKET_SIZE];
+		alignas(16) float t[TRIANGLE_PACKET_SIZE];
+		alignas(16) float u[TRIANGLE_PACKET_SIZE];
+		alignas(16) float v[TRIANGLE_PACKET_SIZE];
+		int hit_mask = 0;
+#ifdef CG_SSE
+		const __m128 sx = _mm_set1_ps(shear.sx);
+		const __m128 sy = _mm_set1_ps(shear.sy);
+		const __m128 sz = _mm_set1_ps(shear.sz);
+		const __m128 position_x = _mm_set1_ps(ray.position[shear.kx]);
+		const __m128 position_y = _mm_set1_ps(ray.position[shear.ky]);
+		const __m128 position_z = _mm_set1_ps(ray.position[shear.kz]);
+
+		const __m128 a_z = _mm_sub_ps(_mm_load_ps(packet.a[shear.kz]), position_z);
+		const __m128 b_z = _mm_sub_ps(_mm_load_ps(packet.b[shear.kz]), position_z);
+		const __m128 c_z = _mm_sub_ps(_mm_load_ps(packet.c[shear.kz]), position_z);
+		const __m128 a_x = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.a[shear.kx]), position_x), _mm_mul_ps(sx, a_z));
+		const __m128 a_y = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.a[shear.ky]), position_y), _mm_mul_ps(sy, a_z));
+		const __m128 b_x = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.b[shear.kx]), position_x), _mm_mul_ps(sx, b_z));
+		const __m128 b_y = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.b[shear.ky]), position_y), _mm_mul_ps(sy, b_z));
+		const __m128 c_x = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.c[shear.kx]), position_x), _mm_mul_ps(sx, c_z));
+		const __m128 c_y = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.c[shear.ky]), position_y), _mm_mul_ps(sy, c_z));
 
-	template<typename VB>
-	inline void aabb<VB>::add_triangle(const triangle<VB> triangle)
+		const __m128 u_4 = _mm_sub_ps(_mm_mul_ps(c_x, b_y), _mm_mul_ps(c_y, b_x));
+		const __m128 v_4 = _mm_sub_ps(_mm_mul_ps(a_x, c_y), _mm_mul_ps(a_y, c_x));
+		const __m128 w_4 = _mm_sub_ps(_mm_mul_ps(b_x, a_y), _mm_mul_ps(b_y, a_x));
+		_mm_store_ps(edge_u, u_4);
+		_mm_store_ps(edge_v, v_4);
+		_mm_store_ps(edge_w, w_4);
+		_mm_store_ps(scaled_t, _mm_mul_ps(sz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(u_4, a_z), _mm_mul_ps(v_4, b_z)), _mm_mul_ps(w_4, c_z))));
+#else
+		float a_x[TRIANGLE_PACKET_SIZE], a_y[TRIANGLE_PACKET_SIZE];
+		float b_x[TRIANGLE_PACKET_SIZE], b_y[TRIANGLE_PACKET_SIZE];
+		float c_x[TRIANGLE_PACKET_SIZE], c_y[TRIANGLE_PACKET_SIZE];
+		for (size_t i = 0; i < TRIANGLE_PACKET_SIZE; i++)
+		{
+			const float a_z = packet.a[shear.kz][i] - ray.position[shear.kz];
+			const float b_z = packet.b[shear.kz][i] - ray.position[shear.kz];
+			const float c_z = packet.c[shear.kz][i] - ray.position[shear.kz];
+			a_x[i] = packet.a[shear.kx][i] - ray.position[shear.kx] - shear.sx * a_z;
+			a_y[i] = packet.a[shear.ky][i] - ray.position[shear.ky] - shear.sy * a_z;
+			b_x[i] = packet.b[shear.kx][i] - ray.position[shear.kx] - shear.sx * b_z;
+			b_y[i] = packet.b[shear.ky][i] - ray.position[shear.ky] - shear.sy * b_z;
+			c_x[i] = packet.c[shear.kx][i] - ray.position[shear.kx] - shear.sx * c_z;
+			c_y[i] = packet.c[shear.ky][i] - ray.position[shear.ky] - shear.sy * c_z;
+			edge_u[i] = c_x[i] * b_y[i] - c_y[i] * b_x[i];
+			edge_v[i] = a_x[i] * c_y[i] - a_y[i] * c_x[i];
+			edge_w[i] = b_x[i] * a_y[i] - b_y[i] * a_x[i];
+			scaled_t[i] = shear.sz * (edge_u[i] * a_z + edge_v[i] * b_z + edge_w[i] * c_z);
+		}
+#endif
+
+		for (size_t i = 0; i < TRIANGLE_PACKET_SIZE; i++)
+		{
+			if (!(lane_mask & (1 << i)))
+				continue;
+
+			// Луч прошёл точно через ребро: во float знак не определён, пересчитываем в double
+			if (edge_u[i] == 0.f || edge_v[i] == 0.f || edge_w[i] == 0.f)
+			{
+				const double a_z = static_cast<double>(packet.a[shear.kz][i]) - ray.position[shear.kz];
+				const double b_z = static_cast<double>(packet.b[shear.kz][i]) - ray.position[shear.kz];
+				const double c_z = static_cast<double>(packet.c[shear.kz][i]) - ray.position[shear.kz];
+				const double ax = static_cast<double>(packet.a[shear.kx][i]) - ray.position[shear.kx] - static_cast<double>(shear.sx) * a_z;
+				const double ay = static_cast<double>(packet.a[shear.ky][i]) - ray.position[shear.ky] - static_cast<double>(shear.sy) * a_z;
+				const double bx = static_cast<double>(packet.b[shear.kx][i]) - ray.position[shear.kx] - static_cast<double>(shear.sx) * b_z;
+				const double by = static_cast<double>(packet.b[shear.ky][i]) - ray.position[shear.ky] - static_cast<double>(shear.sy) * b_z;
+				const double cx = static_cast<double>(packet.c[shear.kx][i]) - ray.position[shear.kx] - static_cast<double>(shear.sx) * c_z;
+				const double cy = static_cast<double>(packet.c[shear.ky][i]) - ray.position[shear.ky] - static_cast<double>(shear.sy) * c_z;
+				edge_u[i] = static_cast<float>(cx * by - cy * bx);
+				edge_v[i] = static_cast<float>(ax * cy - ay * cx);
+				edge_w[i] = static_cast<float>(bx * ay - by * ax);
+				scaled_t[i] = shear.sz * static_cast<float>(edge_u[i] * a_z + edge_v[i] * b_z + edge_w[i] * c_z);
+			}
+
+			if ((edge_u[i] < 0.f || edge_v[i] < 0.f || edge_w[i] < 0.f) &&
+				(edge_u[i] > 0.f || edge_v[i] > 0.f || edge_w[i] > 0.f))
+				continue;
+			const float det = edge_u[i] + edge_v[i] + edge_w[i];
+			if (det == 0.f)
+				continue;
+
+			const float inv_det = 1.f / det;
+			t[i] = scaled_t[i] * inv_det;
+			u[i] = edge_v[i] * inv_det;
+			v[i] = edge_w[i] * inv_det;
+			if (t[i] > min_t && t[i] < max_t)
+				hit_mask |= 1 << i;
+		}
+		return get_closest_lane(hit_mask, t, u, v, lane);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_watertight(bool in_watertight)
 	{
-		// TODO Lab: 2.05 Implement `aabb` class
+		watertight = in_watertight;
 	}
 
-	template<typename VB>
-	inline const std::vector<triangle<VB>>& aabb<VB>::get_triangles() const
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_sampler(sampler_type in_sampler_type)
 	{
-		// TODO Lab: 2.05 Implement `aabb` class
+		path_sampler.set_type(in_sampler_type);
 	}
 
-	template<typename VB>
-	inline bool aabb<VB>::aabb_test(const ray& ray) const
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::begin_path_sample(
+			size_t thread_id, size_t path_id, const uint2& pixel, uint32_t sample_index, size_t bounce, float scatter_pdf) const
+	{
+		// Измерение 0 занято сдвигом внутри пикселя
+		sample_contexts[thread_id].paths[path_id] = path_sample_context{
+				pixel, sample_index, 1 + static_cast<uint32_t>(bounce) * SAMPLER_BOUNCE_DIMENSIONS, scatter_pdf};
+		sample_contexts[thread_id].active_path = path_id;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::select_path(size_t thread_id, size_t path_id) const
 	{
-		// TODO Lab: 2.05 Implement `aabb` class
+		sample_contexts[thread_id].active_path = path_id;
+	}
+
+	template<typename VB, typename RT>
+	inline float2 raytracer<VB, RT>::get_sample_2d() const
+	{
+		return get_sample_2d(sample_contexts[static_cast<size_t>(omp_get_thread_num())].active_path);
+	}
+
+	template<typename VB, typename RT>
+	inline float2 raytracer<VB, RT>::get_sample_2d(size_t path_id) const
+	{
+		path_sample_context& context = sample_contexts[static_cast<size_t>(omp_get_thread_num())].paths[path_id];
+		return path_sampler.get_2d(context.pixel, context.sample_index, context.dimension++);
+	}
+
+	template<typename VB, typename RT>
+	inline float raytracer<VB, RT>::get_scatter_pdf(size_t path_id) const
+	{
+		return sample_contexts[static_cast<size_t>(omp_get_thread_num())].paths[path_id].scatter_pdf;
+	}
+
+	template<typename VB, typename RT>
+	inline const std::vector<bottom_level_structure<VB>>& raytracer<VB, RT>::get_meshes() const
+	{
+		return meshes;
+	}
+
+	template<typename VB, typename RT>
+	inline const std::vector<mesh_instance>& raytracer<VB, RT>::get_instances() const
+	{
+		return top_level_instances;
+	}
+
+	template<typename VB, typename RT>
+	inline float2 raytracer<VB, RT>::get_jitter(const uint2& pixel, uint32_t sample_index) const
+	{
+		// TODO Lab: 2.06 Implement `get_jitter` method of `raytracer` class
+		return path_sampler.get_2d(pixel, sample_index, 0) - 0.5f;
 	}
 
 }// namespace cg::renderer
\ No newline at end of file
@@ -1,8 +1,10 @@
 #include "raytracer_renderer.h"
 
+#include "utils/mapped_file.h"
 #include "utils/resource_utils.h"
 #include "utils/timer.h"
 
+#include <cmath>
 #include <iostream>
 
 
@@ -11,11 +13,168 @@ void cg::renderer::ray_tracing_renderer::init()
 	// TODO Lab: 2.01 Add `render_target`, `camera`, and `raytracer` in `ray_tracing_renderer` class
 	// TODO Lab: 2.03 Add light information to `lights` array of `ray_tracing_renderer`
 	// TODO Lab: 2.04 Initialize `shadow_raytracer` in `ray_tracing_renderer`
+	raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+	raytracer->set_tile_size(settings->tile_size);
+	raytracer->set_adaptive_threshold(settings->adaptive_threshold);
+	raytracer->set_time_budget(settings->time_budget_ms);
+	raytracer->set_russian_roulette_depth(settings->russian_roulette_depth);
+	raytracer->set_sampler(
+			settings->sampler == "r2" ? sampler_type::r2 : (settings->sampler == "blue_noise" ? sampler_type::blue_noise : sampler_type::sobol));
+	raytracer->set_viewport(settings->width, settings->height);
+
+	for (auto& target: render_targets)
+		target = std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height);
+	render_target = render_targets[0];
+	raytracer->set_render_target(render_target);
+
+	load_model();
+	load_camera();
+
+	raytracer->set_vertex_buffers(model->get_vertex_buffers());
+	raytracer->set_index_buffers(model->get_index_buffers());
+	model_bounds = aabb{};
+	rest_vertices.clear();
+	for (const auto& vertex_buffer: model->get_vertex_buffers())
+	{
+		for (size_t i = 0; i < vertex_buffer->count(); i++)
+			model_bounds.add_point(vertex_buffer->item(i).position);
+		// Анимация каждый кадр считается от исходных вершин, а не накапливается
+		if (settings->model_twist != 0.f)
+			rest_vertices.emplace_back(vertex_buffer->get_data(), vertex_buffer->get_data() + vertex_buffer->count());
+	}
+	// Модель повторяется экземплярами на сетке instance_grid x instance_grid позади исходной
+	if (settings->instance_grid > 1)
+	{
+		const float3 spacing = (model_bounds.aabb_max - model_bounds.aabb_min) * 1.25f;
+		for (unsigned int z = 0; z < settings->instance_grid; z++)
+		{
+			for (unsigned int x = 0; x < settings->instance_grid; x++)
+			{
+				const float offset_x = (static_cast<float>(x) - 0.5f * static_cast<float>(settings->instance_grid - 1)) * spacing.x;
+				const float offset_z = -static_cast<float>(z) * spacing.z;
+				raytracer->add_instance(0, float4x4{{1.f, 0.f, 0.f, 0.f}, {0.f, 1.f, 0.f, 0.f}, {0.f, 0.f, 1.f, 0.f}, {offset_x, 0.f, offset_z, 1.f}});
+			}
+		}
+	}
+
+	// Запасной точечный источник для моделей без светящихся треугольников висит над моделью.
+	// Интенсивность подобрана так, чтобы освещённость в центре модели не зависела от её размера
+	const float3 model_center = model_bounds.get_center();
+	const float3 light_position{model_center.x, model_bounds.aabb_max.y + 0.5f * (model_bounds.aabb_max.y - model_bounds.aabb_min.y), model_center.z};
+	const float light_distance = std::max(length(light_position - model_center), 1e-3f);
+	lights.push_back({light_position, float3{0.78f, 0.78f, 0.78f} * (PI * light_distance * light_distance)});
+
+	raytracer->set_watertight(settings->watertight_intersection);
+	raytracer->set_packet_tracing(settings->packet_tracing);
+
+	// Acceleration structure строится один раз; если модель анимирована, дальше BVH только подгоняются
+	raytracer->acceleration_structure.set_builder(
+			settings->bvh_builder == "lbvh" ? bvh_builder::lbvh : (settings->bvh_builder == "sbvh" ? bvh_builder::sbvh : bvh_builder::sah),
+			settings->bvh_treelet_optimization);
+	raytracer->acceleration_structure.set_split_budget(settings->bvh_split_budget);
+	raytracer->acceleration_structure.set_width(settings->bvh_width);
+	raytracer->acceleration_structure.set_rebuild_threshold(settings->bvh_rebuild_threshold);
+	// Кэш лежит рядом с моделью и привязан к её содержимому: изменённый OBJ просто перестроит дерево
+	if (settings->bvh_cache)
+	{
+		std::filesystem::path cache_path = settings->model_path;
+		cache_path.replace_extension(".bvh");
+		raytracer->set_acceleration_structure_cache(cache_path, cg::utils::hash_file(settings->model_path));
+	}
+	raytracer->build_acceleration_structure();
+	raytracer->print_acceleration_structure_statistics();
+
+	update_lights();
+	sampled_lights.print_statistics();
+}
+
+void cg::renderer::ray_tracing_renderer::update_lights()
+{
+	// Светящиеся треугольники собираются после построения BVH: номера в попаданиях — в переупорядоченных массивах.
+	// Треугольник, разрезанный SBVH, лежит в сетке несколько раз, но источником становится один раз
+	const auto& meshes = raytracer->get_meshes();
+	mesh_emissive_ids.assign(meshes.size(), {});
+	std::vector<std::vector<unsigned int>> mesh_emissive_triangles(meshes.size());
+	for (size_t mesh_id = 0; mesh_id < meshes.size(); mesh_id++)
+	{
+		const auto& triangles = meshes[mesh_id].triangles;
+		const auto& primitive_indices = meshes[mesh_id].acceleration_structure.get_primitive_indices();
+		std::vector<unsigned int> primitive_emissive_ids(meshes[mesh_id].acceleration_structure.get_statistics().primitive_count, NO_EMISSIVE_LIGHT);
+		mesh_emissive_ids[mesh_id].assign(triangles.size(), NO_EMISSIVE_LIGHT);
+		for (size_t i = 0; i < triangles.size(); i++)
+		{
+			if (maxelem(triangles[i].emissive) <= 0.f)
+				continue;
+			unsigned int& light_id = primitive_emissive_ids[primitive_indices[i]];
+			if (light_id == NO_EMISSIVE_LIGHT)
+			{
+				light_id = static_cast<unsigned int>(mesh_emissive_triangles[mesh_id].size());
+				mesh_emissive_triangles[mesh_id].push_back(static_cast<unsigned int>(i));
+			}
+			mesh_emissive_ids[mesh_id][i] = light_id;
+		}
+	}
+	std::vector<emissive_triangle> emissive_triangles;
+	instance_light_offsets.clear();
+	for (const auto& instance: raytracer->get_instances())
+	{
+		instance_light_offsets.push_back(static_cast<unsigned int>(emissive_triangles.size()));
+		const auto& triangles = meshes[instance.mesh_id].triangles;
+		for (unsigned int i: mesh_emissive_triangles[instance.mesh_id])
+		{
+			emissive_triangles.push_back({
+					mul(instance.object_to_world, float4{triangles[i].a, 1.f}).xyz(),
+					mul(instance.object_to_world, float4{triangles[i].b, 1.f}).xyz(),
+					mul(instance.object_to_world, float4{triangles[i].c, 1.f}).xyz(),
+					triangles[i].emissive});
+		}
+	}
+	// Светящиеся треугольники уже описывают свет модели: запасной точечный источник осветил бы её второй раз
+	sampled_lights.set_lights(emissive_triangles.empty() ? lights : std::vector<light>{}, emissive_triangles);
 }
 
-void cg::renderer::ray_tracing_renderer::destroy() {}
+void cg::renderer::ray_tracing_renderer::twist_model()
+{
+	// Вершины поворачиваются вокруг вертикальной оси через центр модели на угол, растущий с высотой.
+	// Индексы не меняются, поэтому BVH достаточно подогнать под новые ббоксы
+	const float angle = settings->model_twist * get_sequence_time() * PI / 180.f;
+	const float3 center = model_bounds.get_center();
+	const float height = std::max(model_bounds.aabb_max.y - model_bounds.aabb_min.y, 1e-6f);
+	const auto& vertex_buffers = model->get_vertex_buffers();
+	for (size_t buffer_id = 0; buffer_id < vertex_buffers.size(); buffer_id++)
+	{
+		const std::vector<cg::vertex>& rest_buffer = rest_vertices[buffer_id];
+		auto& vertex_buffer = vertex_buffers[buffer_id];
+#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(rest_buffer.size()); i++)
+		{
+			const cg::vertex& rest = rest_buffer[i];
+			const float vertex_angle = angle * (rest.position.y - model_bounds.aabb_min.y) / height;
+			const float c = cosf(vertex_angle);
+			const float s = sinf(vertex_angle);
+			const float3 offset = rest.position - center;
+			cg::vertex& vertex = vertex_buffer->item(i);
+			vertex.position = center + float3{offset.x * c - offset.z * s, offset.y, offset.x * s + offset.z * c};
+			vertex.normal = float3{rest.normal.x * c - rest.normal.z * s, rest.normal.y, rest.normal.x * s + rest.normal.z * c};
+		}
+	}
 
-void cg::renderer::ray_tracing_renderer::update() {}
+	raytracer->refit_acceleration_structure();
+	raytracer->print_acceleration_structure_statistics();
+	update_lights();
+}
+
+void cg::renderer::ray_tracing_renderer::destroy()
+{
+	wait_for_frame_saves();
+}
+
+void cg::renderer::ray_tracing_renderer::update()
+{
+	update_camera_path();
+	if (settings->model_twist != 0.f)
+		twist_model();
+}
 
 void cg::renderer::ray_tracing_renderer::render()
 {
@@ -26,4 +185,179 @@ void cg::renderer::ray_tracing_renderer::render()
 	// TODO Lab: 2.04 Adjust `closest_hit_shader` of `raytracer` to cast shadows rays and to ignore occluded lights
 	// TODO Lab: 2.05 Adjust `ray_tracing_renderer` class to build the acceleration structure
 	// TODO Lab: 2.06 (Bonus) Adjust `closest_hit_shader` for Monte-Carlo light tracing
+	// Берём свободный буфер кадра: ждём, пока закончится сохранение кадра, который в нём лежал
+	const size_t buffer_id = get_frame_buffer_id();
+	wait_for_frame_buffer(buffer_id);
+	render_target = render_targets[buffer_id];
+	raytracer->set_render_target(render_target);
+
+	raytracer->miss_shader = [](const ray& ray) {
+		payload payload{};
+		payload.color = {0.f, 0.f, (ray.direction.y + 1.f) * 0.5f};
+		return payload;
+	};
+
+	// Модель Ламберта с next-event estimation: на каждое попадание settings->light_samples теневых лучей
+	// к источникам, выбранным по мощности, так что цена попадания не растёт с числом источников.
+	// Свет светящихся треугольников делится между выбором источника и отскоком по BSDF степенной эвристикой MIS
+	raytracer->closest_hit_packet_shader = [&](const ray* rays, payload* payloads, const triangle<cg::vertex>* const* triangles, size_t count, size_t depth) {
+		const float light_samples = static_cast<float>(settings->light_samples);
+		// Отскок по BSDF трассируется, только пока у пути остались отскоки; на последней вершине
+		// (и при raytracing_depth = 1) свет источников приходит лишь через их выбор и берётся с весом 1
+		const bool scatter_follows = depth > 0;
+		std::array<size_t, BVH_PACKET_SIZE> hit_ids;
+		std::array<float3, BVH_PACKET_SIZE> positions;
+		std::array<float3, BVH_PACKET_SIZE> normals;
+		std::array<float3, BVH_PACKET_SIZE> colors;
+		size_t hit_count = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!triangles[i])
+				continue;
+			const payload& payload = payloads[i];
+			const triangle<cg::vertex>& triangle = *triangles[i];
+			positions[hit_count] = rays[i].position + rays[i].direction * payload.t;
+			normals[hit_count] = normalize(
+					payload.bary.x * triangle.na +
+					payload.bary.y * triangle.nb +
+					payload.bary.z * triangle.nc);
+			colors[hit_count] = triangle.emissive;
+
+			// Попадание отскока в источник: эту же точку мог выбрать и next-event estimation на прошлой вершине
+			const float scatter_pdf = raytracer->get_scatter_pdf(i);
+			const unsigned int light_id = get_emissive_light_id(payload);
+			if (scatter_pdf > 0.f && light_id != NO_EMISSIVE_LIGHT)
+			{
+				const float light_cosine = std::abs(dot(normalize(cross(triangle.b - triangle.a, triangle.c - triangle.a)), rays[i].direction));
+				const float light_pdf = light_cosine > 0.f ? light_samples * sampled_lights.get_triangle_pdf(light_id) * payload.t * payload.t / light_cosine : 0.f;
+				colors[hit_count] *= get_power_heuristic(scatter_pdf, light_pdf);
+			}
+			hit_ids[hit_count++] = i;
+		}
+
+		for (size_t sample = 0; sample < settings->light_samples && !sampled_lights.empty(); sample++)
+		{
+			std::array<light_sample, BVH_PACKET_SIZE> samples;
+			std::array<float3, BVH_PACKET_SIZE> contributions;
+			for (size_t j = 0; j < hit_count; j++)
+			{
+				const float2 selection = raytracer->get_sample_2d(hit_ids[j]);
+				const float2 position = raytracer->get_sample_2d(hit_ids[j]);
+				samples[j] = sampled_lights.sample(selection, position);
+				contributions[j] = float3{0.f, 0.f, 0.f};
+
+				const float3 to_light = samples[j].position - positions[j];
+				const float distance = length(to_light);
+				const float cosine = distance > 0.f ? dot(normals[j], to_light) / distance : 0.f;
+				if (cosine <= 0.f)
+					continue;
+				const float3& diffuse = triangles[hit_ids[j]]->diffuse;
+				if (samples[j].delta)
+				{
+					// Точечный источник с интенсивностью emission: та же BRDF Ламберта и затухание 1/d^2, что у треугольников
+					contributions[j] = diffuse * INV_PI * samples[j].emission * cosine / (samples[j].pdf * light_samples * distance * distance);
+					continue;
+				}
+				// Плотность по площади переводится в плотность по телесному углу
+				const float light_cosine = std::abs(dot(samples[j].normal, to_light)) / distance;
+				if (light_cosine <= 0.f || samples[j].pdf <= 0.f)
+					continue;
+				const float light_pdf = light_samples * samples[j].pdf * distance * distance / light_cosine;
+				const float weight = scatter_follows ? get_power_heuristic(light_pdf, cosine * INV_PI) : 1.f;
+				contributions[j] = diffuse * INV_PI * samples[j].emission * cosine * weight / light_pdf;
+			}
+
+			// К точечному источнику теневые лучи идут пакетом от него самого, к треугольникам — по одному
+			std::array<bool, BVH_PACKET_SIZE> tested{};
+			std::array<bool, BVH_PACKET_SIZE> shadowed{};
+			for (size_t j = 0; j < hit_count; j++)
+			{
+				if (tested[j] || maxelem(contributions[j]) <= 0.f)
+					continue;
+				if (!samples[j].delta)
+				{
+					const float3 to_light = samples[j].position - positions[j];
+					shadowed[j] = raytracer->occluded(ray(positions[j], to_light), length(to_light) - 0.001f);
+					continue;
+				}
+				std::array<size_t, BVH_PACKET_SIZE> group;
+				std::array<float3, BVH_PACKET_SIZE> targets;
+				size_t group_size = 0;
+				for (size_t k = j; k < hit_count; k++)
+				{
+					if (!tested[k] && samples[k].delta && samples[k].light_id == samples[j].light_id && maxelem(contributions[k]) > 0.f)
+					{
+						tested[k] = true;
+						targets[group_size] = positions[k];
+						group[group_size++] = k;
+					}
+				}
+				std::array<bool, BVH_PACKET_SIZE> group_shadowed;
+				raytracer->occluded_packet(samples[j].position, targets.data(), group_size, group_shadowed.data());
+				for (size_t k = 0; k < group_size; k++)
+					shadowed[group[k]] = group_shadowed[k];
+			}
+
+			for (size_t j = 0; j < hit_count; j++)
+			{
+				if (!shadowed[j])
+					colors[j] += contributions[j];
+			}
+		}
+
+		for (size_t j = 0; j < hit_count; j++)
+			payloads[hit_ids[j]].color = cg::color::from_float3(colors[j]);
+	};
+
+	// Одиночные лучи шейдятся тем же кодом как пакет из одного луча
+	raytracer->closest_hit_shader = [&](const ray& ray, payload& payload, const triangle<cg::vertex>& triangle, size_t depth) {
+		const cg::renderer::triangle<cg::vertex>* hit_triangle = &triangle;
+		raytracer->closest_hit_packet_shader(&ray, &payload, &hit_triangle, 1, depth);
+		return payload;
+	};
+
+	// Диффузный отскок для raytracing_depth > 1: направление выбирается по косинусу вокруг нормали,
+	// тогда косинус и плотность сокращаются и ослабление равно альбедо
+	raytracer->scatter_shader = [&](const ray& ray, const payload& payload, const triangle<cg::vertex>& triangle, cg::renderer::ray& scattered, float3& attenuation, float& pdf) {
+		float3 normal = normalize(
+				payload.bary.x * triangle.na +
+				payload.bary.y * triangle.nb +
+				payload.bary.z * triangle.nc);
+		if (dot(normal, ray.direction) > 0.f)
+			normal = -normal;
+
+		const float3 tangent = normalize(cross(std::abs(normal.x) > 0.5f ? float3{0.f, 1.f, 0.f} : float3{1.f, 0.f, 0.f}, normal));
+		const float3 bitangent = cross(normal, tangent);
+		const float2 sample = raytracer->get_sample_2d();
+		const float radius_squared = sample.x;
+		const float radius = std::sqrt(radius_squared);
+		const float phi = 2.f * PI * sample.y;
+		const float cosine = std::sqrt(std::max(1.f - radius_squared, 0.f));
+		const float3 direction = tangent * (radius * std::cos(phi)) + bitangent * (radius * std::sin(phi)) + normal * cosine;
+
+		scattered = cg::renderer::ray(ray.position + ray.direction * payload.t, direction);
+		attenuation = triangle.diffuse;
+		pdf = cosine * INV_PI;
+		return true;
+	};
+
+	raytracer->clear_render_target({0, 0, 0});
+	{
+		cg::utils::timer timer("Ray generation");
+		raytracer->ray_generation(
+				camera->get_position(), camera->get_direction(),
+				camera->get_right(), camera->get_up(),
+				settings->raytracing_depth, settings->accumulation_num);
+	}
+	raytracer->scheduler.print_statistics();
+	raytracer->print_sampling_statistics();
+
+	save_frame(render_target, buffer_id);
+}
+
+unsigned int cg::renderer::ray_tracing_renderer::get_emissive_light_id(const payload& payload) const
+{
+	const mesh_instance& instance = raytracer->get_instances()[payload.instance_id];
+	const unsigned int emissive_id = mesh_emissive_ids[instance.mesh_id][payload.primitive_id];
+	return emissive_id == NO_EMISSIVE_LIGHT ? NO_EMISSIVE_LIGHT : instance_light_offsets[payload.instance_id] + emissive_id;
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#include "renderer/raytracer/light_sampler.h"
 #include "renderer/raytracer/raytracer.h"
 #include "renderer/renderer.h"
 #include "resource.h"
@@ -5,6 +6,8 @@
 
 namespace cg::renderer
 {
+	static constexpr unsigned int NO_EMISSIVE_LIGHT = ~0u;
+
 	class ray_tracing_renderer : public renderer
 	{
 	public:
@@ -15,11 +18,28 @@ namespace cg::renderer
 		virtual void render();
 
 	protected:
+		// Двойная буферизация: в один render target трассируем, другой в это время сохраняется
+		std::array<std::shared_ptr<cg::resource<cg::unsigned_color>>, FRAME_BUFFER_NUM> render_targets;
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 
 		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> raytracer;
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
 
 		std::vector<cg::renderer::light> lights;
+		// Точечные источники и светящиеся треугольники для выбора по мощности
+		cg::renderer::light_sampler sampled_lights;
+		// Светящиеся треугольники экземпляра занимают в sampled_lights подряд идущие номера с instance_light_offsets[экземпляр];
+		// mesh_emissive_ids — номер треугольника сетки среди её светящихся, NO_EMISSIVE_LIGHT — не светится
+		std::vector<unsigned int> instance_light_offsets;
+		std::vector<std::vector<unsigned int>> mesh_emissive_ids;
+
+		// Ббокс модели в исходной позе и её вершины для анимации
+		aabb model_bounds;
+		std::vector<std::vector<cg::vertex>> rest_vertices;
+
+		unsigned int get_emissive_light_id(const payload& payload) const;
+		// Собирает светящиеся треугольники заново: после перестроения BVH их номера в сетках меняются
+		void update_lights();
+		// Закручивает модель на кадр последовательности и подгоняет под неё BVH
+		void twist_model();
 	};
 }// namespace cg::renderer
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+using namespace cg::renderer;
+
+void cg::renderer::sampler::set_type(sampler_type in_type)
+{
+	type = in_type;
+	if (type == sampler_type::blue_noise && blue_noise.empty())
+		generate_blue_noise();
+}
+
+void cg::renderer::sampler::generate_blue_noise()
+{
+	// Void-and-cluster (Ulichney 1993). Энергия пикселя — сумма гауссиан от занятых пикселей на торе.
+	// Ранг пикселя — момент, когда он попадает в узор, остающийся равномерно разрежённым на каждом шаге
+	constexpr size_t size = BLUE_NOISE_SIZE;
+	constexpr size_t count = size * size;
+	constexpr float sigma = 1.5f;
+
+	std::vector<float> kernel(count);
+	for (size_t y = 0; y < size; y++)
+	{
+		for (size_t x = 0; x < size; x++)
+		{
+			const float dx = static_cast<float>(std::min(x, size - x));
+			const float dy = static_cast<float>(std::min(y, size - y));
+			kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.f * sigma * sigma));
+		}
+	}
+
+	auto update_energy = [&](std::vector<float>& energy, size_t pixel, float sign) {
+		const size_t pixel_x = pixel % size;
+		const size_t pixel_y = pixel / size;
+		for (size_t y = 0; y < size; y++)
+		{
+			const size_t kernel_row = ((y + size - pixel_y) % size) * size;
+			for (size_t x = 0; x < size; x++)
+				energy[y * size + x] += sign * kernel[kernel_row + (x + size - pixel_x) % size];
+		}
+	};
+	// Самый плотный кластер — занятый пиксель с наибольшей энергией, самая большая пустота — свободный с наименьшей
+	auto find_tightest_cluster = [&](const std::vector<uint8_t>& pattern, const std::vector<float>& energy) {
+		size_t best = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (pattern[i] && (!pattern[best] || energy[i] > energy[best]))
+				best = i;
+		}
+		return best;
+	};
+	auto find_largest_void = [&](const std::vector<uint8_t>& pattern, const std::vector<float>& energy) {
+		size_t best = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!pattern[i] && (pattern[best] || energy[i] < energy[best]))
+				best = i;
+		}
+		return best;
+	};
+
+	// Начальный узор — десятая часть пикселей, выбранных хешем, затем перекладываем точки
+	// из кластеров в пустоты, пока узор не перестанет меняться
+	std::vector<uint8_t> pattern(count, 0);
+	std::vector<float> energy(count, 0.f);
+	const size_t initial_count = count / 10;
+	for (uint32_t i = 0, placed = 0; placed < initial_count; i++)
+	{
+		const size_t pixel = hash_uint(i) % count;
+		if (pattern[pixel])
+			continue;
+		pattern[pixel] = 1;
+		update_energy(energy, pixel, 1.f);
+		placed++;
+	}
+	while (true)
+	{
+		const size_t cluster = find_tightest_cluster(pattern, energy);
+		pattern[cluster] = 0;
+		update_energy(energy, cluster, -1.f);
+		const size_t void_pixel = find_largest_void(pattern, energy);
+		pattern[void_pixel] = 1;
+		update_energy(energy, void_pixel, 1.f);
+		if (void_pixel == cluster)
+			break;
+	}
+
+	std::vector<uint32_t> ranks(count);
+	// Точки начального узора получают ранги от последней к первой, пока их по одной убирают из кластеров
+	{
+		std::vector<uint8_t> shrinking_pattern = pattern;
+		std::vector<float> shrinking_energy = energy;
+		for (size_t rank = initial_count; rank > 0; rank--)
+		{
+			const size_t cluster = find_tightest_cluster(shrinking_pattern, shrinking_energy);
+			shrinking_pattern[cluster] = 0;
+			update_energy(shrinking_energy, cluster, -1.f);
+			ranks[cluster] = static_cast<uint32_t>(rank - 1);
+		}
+	}
+	// Остальные заполняют пустоты. После половины это то же, что убирать самый плотный кластер свободных
+	for (size_t rank = initial_count; rank < count; rank++)
+	{
+		const size_t void_pixel = find_largest_void(pattern, energy);
+		pattern[void_pixel] = 1;
+		update_energy(energy, void_pixel, 1.f);
+		ranks[void_pixel] = static_cast<uint32_t>(rank);
+	}
+
+	// Ранг r переходит в середину r-го интервала [0, 2^32)
+	blue_noise.resize(count);
+	for (size_t i = 0; i < count; i++)
+		blue_noise[i] = static_cast<uint32_t>((2 * static_cast<uint64_t>(ranks[i]) + 1) * (uint64_t{1} << 32) / (2 * count));
+}
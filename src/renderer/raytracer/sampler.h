@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <linalg.h>
+#include <vector>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	// Измерение 0 — сдвиг внутри пикселя, дальше каждый отскок пути берёт свои SAMPLER_BOUNCE_DIMENSIONS
+	// двумерных измерений: отсчёты разных отскоков и разных решений на одном отскоке не коррелируют.
+	// Запас рассчитан на выбор источников (по два измерения на теневой луч) и продолжение пути
+	static constexpr uint32_t SAMPLER_BOUNCE_DIMENSIONS = 32;
+	// Сторона тайла маски синего шума, степень двойки
+	static constexpr uint32_t BLUE_NOISE_SIZE = 64;
+
+	enum class sampler_type
+	{
+		sobol,
+		r2,
+		blue_noise
+	};
+
+	// Хеш lowbias32: дешёвый и хорошо перемешивает все биты
+	inline uint32_t hash_uint(uint32_t value)
+	{
+		value ^= value >> 16;
+		value *= 0x7feb352du;
+		value ^= value >> 15;
+		value *= 0x846ca68bu;
+		value ^= value >> 16;
+		return value;
+	}
+
+	inline uint32_t hash_combine(uint32_t seed, uint32_t value)
+	{
+		return hash_uint(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+	}
+
+	inline uint32_t reverse_bits(uint32_t value)
+	{
+		value = (value << 16) | (value >> 16);
+		value = ((value & 0x00ff00ffu) << 8) | ((value & 0xff00ff00u) >> 8);
+		value = ((value & 0x0f0f0f0fu) << 4) | ((value & 0xf0f0f0f0u) >> 4);
+		value = ((value & 0x33333333u) << 2) | ((value & 0xccccccccu) >> 2);
+		value = ((value & 0x55555555u) << 1) | ((value & 0xaaaaaaaau) >> 1);
+		return value;
+	}
+
+	// Перемешивание Оуэна через хеш (Burley 2020): меняет порядок узлов на каждом уровне
+	// двоичного дерева, сохраняя стратификацию последовательности
+	inline uint32_t nested_uniform_scramble(uint32_t value, uint32_t seed)
+	{
+		value = reverse_bits(value);
+		value += seed;
+		value ^= value * 0x6c50b47cu;
+		value ^= value * 0xb82f1e52u;
+		value ^= value * 0xc7afe638u;
+		value ^= value * 0x8d22f6e6u;
+		return reverse_bits(value);
+	}
+
+	// Второе измерение Соболя; первое — просто обращение битов номера
+	inline uint32_t get_sobol_second_dimension(uint32_t index)
+	{
+		uint32_t result = 0;
+		for (uint32_t direction = 1u << 31; index != 0; index >>= 1, direction ^= direction >> 1)
+		{
+			if (index & 1u)
+				result ^= direction;
+		}
+		return result;
+	}
+
+	// 32-битная дробь в [0, 1): старшие 24 бита точно представимы во float
+	inline float to_unit_float(uint32_t value)
+	{
+		return static_cast<float>(value >> 8) * (1.f / 16777216.f);
+	}
+
+	// Квазислучайные отсчёты без состояния: значение зависит только от пикселя, номера отсчёта
+	// и измерения, поэтому пути можно продолжать в любом порядке и в любом потоке
+	class sampler
+	{
+	public:
+		void set_type(sampler_type in_type);
+		// Точка в [0, 1)^2
+		float2 get_2d(const uint2& pixel, uint32_t sample_index, uint32_t dimension) const;
+
+	protected:
+		sampler_type type = sampler_type::sobol;
+		// Ранги void-and-cluster, нормированные в [0, 2^32)
+		std::vector<uint32_t> blue_noise;
+
+		float2 get_sobol(uint32_t index, uint32_t seed) const;
+		void generate_blue_noise();
+	};
+
+	inline float2 sampler::get_sobol(uint32_t index, uint32_t seed) const
+	{
+		// Номер тоже перемешивается: иначе у всех пикселей одинаковый порядок отсчётов
+		index = nested_uniform_scramble(index, seed);
+		const uint32_t x = nested_uniform_scramble(reverse_bits(index), hash_combine(seed, 0));
+		const uint32_t y = nested_uniform_scramble(get_sobol_second_dimension(index), hash_combine(seed, 1));
+		return float2{to_unit_float(x), to_unit_float(y)};
+	}
+
+	inline float2 sampler::get_2d(const uint2& pixel, uint32_t sample_index, uint32_t dimension) const
+	{
+		const uint32_t pixel_seed = hash_combine(hash_uint(pixel.x), pixel.y);
+		switch (type)
+		{
+			case sampler_type::r2:
+			{
+				// R2 (Roberts 2018) в фиксированной точке: n * alpha по модулю 2^32 — точная дробная часть.
+				// Каждому пикселю и измерению — свой сдвиг Кранли—Паттерсона
+				const uint32_t offset_seed = hash_combine(pixel_seed, dimension);
+				const uint32_t x = hash_combine(offset_seed, 0) + sample_index * 3242174889u;
+				const uint32_t y = hash_combine(offset_seed, 1) + sample_index * 2447445414u;
+				return float2{to_unit_float(x), to_unit_float(y)};
+			}
+			case sampler_type::blue_noise:
+			{
+				// Одна и та же последовательность Соболя во всех пикселях, сдвинутая на значение маски синего шума:
+				// ошибка соседних пикселей расходится в высокие частоты. Для каждого измерения маска сдвинута по тору
+				const uint32_t dimension_seed = hash_uint(dimension);
+				const uint32_t mask = BLUE_NOISE_SIZE - 1;
+				const uint32_t shift_x = dimension_seed & mask;
+				const uint32_t shift_y = (dimension_seed >> 8) & mask;
+				const uint32_t index = ((pixel.y + shift_y) & mask) * BLUE_NOISE_SIZE + ((pixel.x + shift_x) & mask);
+				const uint32_t second_index = ((pixel.y + shift_y + BLUE_NOISE_SIZE / 2) & mask) * BLUE_NOISE_SIZE + ((pixel.x + shift_x + BLUE_NOISE_SIZE / 3) & mask);
+				const uint32_t index_seed = hash_combine(dimension_seed, 0x5bd1e995u);
+				const uint32_t shuffled = nested_uniform_scramble(sample_index, index_seed);
+				const uint32_t x = nested_uniform_scramble(reverse_bits(shuffled), hash_combine(index_seed, 0)) + blue_noise[index];
+				const uint32_t y = nested_uniform_scramble(get_sobol_second_dimension(shuffled), hash_combine(index_seed, 1)) + blue_noise[second_index];
+				return float2{to_unit_float(x), to_unit_float(y)};
+			}
+			default:
+				return get_sobol(sample_index, hash_combine(pixel_seed, dimension));
+		}
+	}
+}// namespace cg::renderer
@@ -0,0 +1,130 @@
+#include "tile_scheduler.h"
+
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <iostream>
+#include <numeric>
+
+
+using namespace cg::renderer;
+
+void cg::renderer::tile_scheduler::set_viewport(size_t width, size_t height, size_t tile_size)
+{
+	if (tile_size == 0)
+		THROW_ERROR("Tile size should be positive");
+
+	const size_t tiles_x = (width + tile_size - 1) / tile_size;
+	const size_t tiles_y = (height + tile_size - 1) / tile_size;
+	size_t order = 1;
+	while (order < std::max(tiles_x, tiles_y))
+		order *= 2;
+
+	std::vector<std::pair<uint64_t, image_tile>> ordered_tiles;
+	ordered_tiles.reserve(tiles_x * tiles_y);
+	for (size_t y = 0; y < tiles_y; y++)
+	{
+		for (size_t x = 0; x < tiles_x; x++)
+		{
+			const image_tile tile{
+					x * tile_size, y * tile_size,
+					std::min(tile_size, width - x * tile_size), std::min(tile_size, height - y * tile_size)};
+			ordered_tiles.emplace_back(get_hilbert_index(order, x, y), tile);
+		}
+	}
+	std::sort(ordered_tiles.begin(), ordered_tiles.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+	tiles.clear();
+	tiles.reserve(ordered_tiles.size());
+	for (const auto& ordered_tile: ordered_tiles)
+		tiles.push_back(ordered_tile.second);
+}
+
+const std::vector<image_tile>& cg::renderer::tile_scheduler::get_tiles() const
+{
+	return tiles;
+}
+
+void cg::renderer::tile_scheduler::reset_statistics()
+{
+	std::fill(busy_time.begin(), busy_time.end(), 0.);
+	std::fill(stolen_count.begin(), stolen_count.end(), 0);
+	wall_time = 0.;
+}
+
+void cg::renderer::tile_scheduler::print_statistics() const
+{
+	if (busy_time.empty())
+		return;
+	const double total_busy = std::accumulate(busy_time.begin(), busy_time.end(), 0.);
+	const auto [min_busy, max_busy] = std::minmax_element(busy_time.begin(), busy_time.end());
+	// Загрузка — доля времени, которое потоки работали, от времени всех потоков на весь проход
+	const double utilization = wall_time > 0. ? total_busy / (wall_time * static_cast<double>(busy_time.size())) : 1.;
+	std::cout << "Tile scheduler: " << tiles.size() << " tiles, " << busy_time.size() << " threads, "
+			  << "busy min " << *min_busy << "ms, max " << *max_busy << "ms, "
+			  << "utilization " << utilization * 100. << "%, "
+			  << std::accumulate(stolen_count.begin(), stolen_count.end(), size_t{0}) << " items stolen\n";
+	std::cout << "Busy time per thread (ms):";
+	for (double time: busy_time)
+		std::cout << " " << time;
+	std::cout << "\n";
+}
+
+uint64_t cg::renderer::tile_scheduler::get_hilbert_index(size_t order, size_t x, size_t y)
+{
+	// Номер клетки (x, y) на кривой Гильберта в квадрате order x order, order — степень двойки
+	uint64_t index = 0;
+	for (size_t s = order / 2; s > 0; s /= 2)
+	{
+		const size_t rx = (x & s) ? 1 : 0;
+		const size_t ry = (y & s) ? 1 : 0;
+		index += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+		// Поворачиваем четверть, чтобы кривая в ней начиналась там, где кончилась предыдущая
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - (x & (s - 1));
+				y = s - 1 - (y & (s - 1));
+			}
+			std::swap(x, y);
+		}
+	}
+	return index;
+}
+
+bool cg::renderer::tile_scheduler::pop_front(size_t range_id, size_t& item)
+{
+	std::atomic<uint64_t>& bounds = ranges[range_id].bounds;
+	uint64_t current = bounds.load(std::memory_order_relaxed);
+	while (true)
+	{
+		const uint64_t front = current >> 32;
+		const uint64_t back = current & 0xFFFFFFFFu;
+		if (front >= back)
+			return false;
+		if (bounds.compare_exchange_weak(current, ((front + 1) << 32) | back, std::memory_order_relaxed))
+		{
+			item = static_cast<size_t>(front);
+			return true;
+		}
+	}
+}
+
+bool cg::renderer::tile_scheduler::steal_back(size_t range_id, size_t& item)
+{
+	std::atomic<uint64_t>& bounds = ranges[range_id].bounds;
+	uint64_t current = bounds.load(std::memory_order_relaxed);
+	while (true)
+	{
+		const uint64_t front = current >> 32;
+		const uint64_t back = current & 0xFFFFFFFFu;
+		if (front >= back)
+			return false;
+		if (bounds.compare_exchange_weak(current, (front << 32) | (back - 1), std::memory_order_relaxed))
+		{
+			item = static_cast<size_t>(back - 1);
+			return true;
+		}
+	}
+}
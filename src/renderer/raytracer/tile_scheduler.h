@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <omp.h>
+#include <vector>
+
+namespace cg::renderer
+{
+	static constexpr size_t TILE_SIZE = 16;
+
+	// Плитка кадра: пиксели [x, x + width) x [y, y + height)
+	struct image_tile
+	{
+		size_t x;
+		size_t y;
+		size_t width;
+		size_t height;
+	};
+
+	// Раздаёт работу потокам OpenMP с воровством: элементы делятся на непрерывные куски по числу потоков,
+	// поток берёт элементы с начала своего куска, а закончив его — ворует с конца чужих.
+	// Плитки кадра упорядочены по кривой Гильберта, так что кусок потока — компактная область кадра
+	class tile_scheduler
+	{
+	public:
+		void set_viewport(size_t width, size_t height, size_t tile_size);
+		const std::vector<image_tile>& get_tiles() const;
+
+		// Вызывает work(item, thread_id) для каждого item из [0, item_count)
+		template<typename F>
+		void run(size_t item_count, F&& work);
+
+		// Время работы каждого потока копится между вызовами reset_statistics
+		void reset_statistics();
+		void print_statistics() const;
+
+	protected:
+		// Границы [front, back) куска упакованы в одно слово: владелец и вор сдвигают их одним CAS
+		struct alignas(64) work_range
+		{
+			std::atomic<uint64_t> bounds;
+		};
+
+		std::vector<image_tile> tiles;
+		std::unique_ptr<work_range[]> ranges;
+		size_t range_count = 0;
+		std::vector<double> busy_time;
+		std::vector<size_t> stolen_count;
+		double wall_time = 0.;
+
+		static uint64_t get_hilbert_index(size_t order, size_t x, size_t y);
+		bool pop_front(size_t range_id, size_t& item);
+		bool steal_back(size_t range_id, size_t& item);
+	};
+
+	template<typename F>
+	inline void tile_scheduler::run(size_t item_count, F&& work)
+	{
+		using duration = std::chrono::duration<double, std::milli>;
+		const size_t thread_num = static_cast<size_t>(omp_get_max_threads());
+		if (range_count < thread_num)
+		{
+			ranges = std::make_unique<work_range[]>(thread_num);
+			range_count = thread_num;
+		}
+		if (busy_time.size() < thread_num)
+		{
+			busy_time.resize(thread_num, 0.);
+			stolen_count.resize(thread_num, 0);
+		}
+		for (size_t i = 0; i < thread_num; i++)
+		{
+			const uint64_t front = item_count * i / thread_num;
+			const uint64_t back = item_count * (i + 1) / thread_num;
+			ranges[i].bounds.store((front << 32) | back, std::memory_order_relaxed);
+		}
+
+		const auto start = std::chrono::high_resolution_clock::now();
+#pragma omp parallel num_threads(static_cast<int>(thread_num))
+		{
+			// Если потоков выдали меньше, куски недостающих целиком разворуют остальные
+			const size_t thread_id = static_cast<size_t>(omp_get_thread_num());
+			const auto thread_start = std::chrono::high_resolution_clock::now();
+			size_t item;
+			while (pop_front(thread_id, item))
+				work(item, thread_id);
+			// Начинаем с соседа: конец его куска примыкает к нашему в порядке обхода
+			size_t stolen = 0;
+			for (size_t offset = 1; offset < thread_num; offset++)
+			{
+				const size_t victim = (thread_id + offset) % thread_num;
+				while (steal_back(victim, item))
+				{
+					work(item, thread_id);
+					stolen++;
+				}
+			}
+			busy_time[thread_id] += duration(std::chrono::high_resolution_clock::now() - thread_start).count();
+			stolen_count[thread_id] += stolen;
+		}
+		wall_time += duration(std::chrono::high_resolution_clock::now() - start).count();
+	}
+}// namespace cg::renderer
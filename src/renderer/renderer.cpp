@@ -1,6 +1,9 @@
 #include "renderer.h"
 
 #include "utils/error_handler.h"
+#include "utils/resource_utils.h"
+
+#include <cstdio>
 
 #ifdef RASTERIZATION
 #include "renderer/rasterizer/rasterizer_renderer.h"
@@ -124,3 +127,86 @@ void cg::renderer::renderer::load_camera()
     cam->set_z_far(settings->camera_z_far);
     camera = cam;
 }
+
+void cg::renderer::renderer::update_camera_path()
+{
+	// Интерполяция камеры между начальными и конечными настройками по номеру кадра
+	const bool turntable = settings->camera_path == "turntable";
+	const float t = get_sequence_time();
+
+	float3 start{0.f, 1.f, 5.f};
+	if (settings->camera_position.size() >= 3)
+		start = float3{settings->camera_position[0], settings->camera_position[1], settings->camera_position[2]};
+	float3 end = start;
+	if (settings->camera_position_end.size() >= 3)
+		end = float3{settings->camera_position_end[0], settings->camera_position_end[1], settings->camera_position_end[2]};
+
+	float3 position = start + (end - start) * t;
+	float theta = settings->camera_theta + (settings->camera_theta_end - settings->camera_theta) * t;
+	float phi = settings->camera_phi + (settings->camera_phi_end - settings->camera_phi) * t;
+
+	if (turntable)
+	{
+		// Полный оборот вокруг оси Y; направление взгляда поворачивается вместе с позицией
+		const float angle = 360.f * t;
+		const float radians = angle * 3.14159265f / 180.f;
+		const float c = cosf(radians);
+		const float s = sinf(radians);
+		position = float3{position.x * c - position.z * s, position.y, position.x * s + position.z * c};
+		theta += angle;
+	}
+
+	camera->set_position(position);
+	camera->set_theta(theta);
+	camera->set_phi(phi);
+}
+
+float cg::renderer::renderer::get_sequence_time() const
+{
+	if (settings->camera_path == "turntable")
+		return static_cast<float>(frame_id) / static_cast<float>(settings->frame_num);
+	if (settings->frame_num > 1)
+		return static_cast<float>(frame_id) / static_cast<float>(settings->frame_num - 1);
+	return 0.f;
+}
+
+size_t cg::renderer::renderer::get_frame_buffer_id() const
+{
+	return frame_id % FRAME_BUFFER_NUM;
+}
+
+void cg::renderer::renderer::wait_for_frame_buffer(size_t buffer_id)
+{
+	if (frame_saves[buffer_id].valid())
+		frame_saves[buffer_id].get();
+}
+
+void cg::renderer::renderer::save_frame(std::shared_ptr<cg::resource<cg::unsigned_color>> frame, size_t buffer_id)
+{
+	const std::filesystem::path path = get_frame_path();
+	// Просмотрщик открываем только для одиночного кадра
+	const bool open_viewer = settings->frame_num == 1;
+	frame_saves[buffer_id] = std::async(std::launch::async, [frame, path, open_viewer]() {
+		cg::utils::save_resource(*frame, path, open_viewer);
+	});
+	++frame_id;
+}
+
+void cg::renderer::renderer::wait_for_frame_saves()
+{
+	for (size_t buffer_id = 0; buffer_id < FRAME_BUFFER_NUM; ++buffer_id)
+		wait_for_frame_buffer(buffer_id);
+}
+
+std::filesystem::path cg::renderer::renderer::get_frame_path() const
+{
+	if (settings->frame_num == 1)
+		return settings->result_path;
+
+	// result.png -> result_0000.png, result_0001.png, ...
+	char suffix[16];
+	std::snprintf(suffix, sizeof(suffix), "_%04zu", frame_id);
+	std::filesystem::path path = settings->result_path;
+	path.replace_filename(path.stem().string() + suffix + path.extension().string());
+	return path;
+}
@@ -1,9 +1,13 @@
 #pragma once
 
+#include "resource.h"
 #include "settings.h"
 #include "world/camera.h"
 #include "world/model.h"
 
+#include <array>
+#include <future>
+
 
 namespace cg::renderer
 {
@@ -31,6 +35,10 @@ namespace cg::renderer
 		void load_model();
 		void load_camera();
 
+		void update_camera_path();
+		// Положение кадра в последовательности от 0 до 1; для turntable последний кадр не повторяет первый
+		float get_sequence_time() const;
+
 	protected:
 		std::shared_ptr<cg::settings> settings;
 
@@ -40,6 +48,17 @@ namespace cg::renderer
 		std::chrono::time_point<std::chrono::high_resolution_clock> current_time =
 				std::chrono::high_resolution_clock::now();
 		float frame_duration = 0.f;
+
+		// Последовательность кадров: пока кадр N кодируется в файл, рендерится кадр N+1 в другой буфер
+		static constexpr size_t FRAME_BUFFER_NUM = 2;
+		size_t frame_id = 0;
+		std::array<std::future<void>, FRAME_BUFFER_NUM> frame_saves;
+
+		size_t get_frame_buffer_id() const;
+		void wait_for_frame_buffer(size_t buffer_id);
+		void save_frame(std::shared_ptr<cg::resource<cg::unsigned_color>> frame, size_t buffer_id);
+		void wait_for_frame_saves();
+		std::filesystem::path get_frame_path() const;
 	};
 
 
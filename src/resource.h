@@ -17,20 +17,42 @@ namespace cg
 	public:
 		resource(size_t size);
 		resource(size_t x_size, size_t y_size);
+		resource(size_t x_size, size_t y_size, size_t tile_size);
 		~resource();
 
+		// Для тайлового ресурса get_data, item(item) и count работают с хранилищем в порядке тайлов,
+		// а не с построчными пикселями; построчная копия — linearize, доступ к пикселю — item(x, y)
 		const T* get_data();
 		T& item(size_t item);
 		T& item(size_t x, size_t y);
 
+		void clear(const T& value);
+		void resolve();
+		std::vector<T> linearize();
+
 		size_t size_bytes() const;
+		// Вместе с дополнением до целого числа тайлов
 		size_t count() const;
 		size_t get_stride() const;
+		size_t get_y_size() const;
+		size_t get_tile_size() const;
 
 	private:
 		std::vector<T> data;
 		size_t item_size = sizeof(T);
 		size_t stride;
+		size_t y_size;
+
+		// Блочно-линейное хранение: тайлы tile_size x tile_size элементов лежат друг за другом
+		size_t tile_size = 0;
+		size_t tile_shift = 0;
+		size_t tiles_x = 0;
+
+		// Fast clear: помеченный тайл заполняется clear_value только при первом обращении
+		std::vector<uint8_t> tile_cleared;
+		T clear_value{};
+
+		void materialize_tile(size_t tile);
 	};
 
 	template<typename T>
@@ -39,6 +61,7 @@ namespace cg
 		// TODO Lab: 1.02 Implement `cg::resource` class
 		data.resize(size);
         stride = size;         
+		y_size = 1;
 	}
 	template<typename T>
 	inline resource<T>::resource(size_t x_size, size_t y_size)
@@ -46,6 +69,25 @@ namespace cg
 		// TODO Lab: 1.02 Implement `cg::resource` class
 		data.resize(x_size * y_size);
 		stride = x_size; 
+		this->y_size = y_size;
+	}
+	template<typename T>
+	inline resource<T>::resource(size_t x_size, size_t y_size, size_t tile_size)
+		: resource(x_size, y_size)
+	{
+		if (tile_size == 0)
+			return;
+		if ((tile_size & (tile_size - 1)) != 0)
+			THROW_ERROR("resource tile size must be a power of two");
+
+		this->tile_size = tile_size;
+		while ((size_t(1) << tile_shift) < tile_size)
+			++tile_shift;
+		// Размеры дополняются до целого числа тайлов
+		tiles_x = (x_size + tile_size - 1) / tile_size;
+		const size_t tiles_y = (y_size + tile_size - 1) / tile_size;
+		data.resize(tiles_x * tiles_y * tile_size * tile_size);
+		tile_cleared.assign(tiles_x * tiles_y, 0);
 	}
 	template<typename T>
 	inline resource<T>::~resource()
@@ -55,6 +97,7 @@ namespace cg
 	inline const T* resource<T>::get_data()
 	{
 		// TODO Lab: 1.02 Implement `cg::resource` class
+		resolve();
 		return data.data();
 		return nullptr;
 	}
@@ -64,18 +107,81 @@ namespace cg
 		// TODO Lab: 1.02 Implement `cg::resource` class
 		if (item >= data.size())
 			THROW_ERROR("resource::item(linear) out of range");
+		if (tile_size && tile_cleared[item >> (2 * tile_shift)])
+			materialize_tile(item >> (2 * tile_shift));
 		return data[item];
 	}
 	template<typename T>
 	inline T& resource<T>::item(size_t x, size_t y)
 	{
 		// TODO Lab: 1.02 Implement `cg::resource` class
+		if (tile_size) {
+			if (x >= stride || y >= y_size)
+				THROW_ERROR("resource::item(x,y) out of range");
+			const size_t tile_mask = tile_size - 1;
+			const size_t tile = (y >> tile_shift) * tiles_x + (x >> tile_shift);
+			if (tile_cleared[tile])
+				materialize_tile(tile);
+			return data[(tile << (2 * tile_shift)) + ((y & tile_mask) << tile_shift) + (x & tile_mask)];
+		}
 		const size_t idx = y * stride + x;
 		if (idx >= data.size())
 			THROW_ERROR("resource::item(x,y) out of range");
 		return data[idx];
 	}
 	template<typename T>
+	inline void resource<T>::clear(const T& value)
+	{
+		if (!tile_size) {
+			std::fill(data.begin(), data.end(), value);
+			return;
+		}
+		// Только помечаем тайлы, сами данные не трогаем
+		clear_value = value;
+		std::fill(tile_cleared.begin(), tile_cleared.end(), uint8_t(1));
+	}
+	template<typename T>
+	inline void resource<T>::resolve()
+	{
+		for (size_t tile = 0; tile < tile_cleared.size(); ++tile) {
+			if (tile_cleared[tile])
+				materialize_tile(tile);
+		}
+	}
+	template<typename T>
+	inline void resource<T>::materialize_tile(size_t tile)
+	{
+		auto begin = data.begin() + (tile << (2 * tile_shift));
+		std::fill(begin, begin + (tile_size << tile_shift), clear_value);
+		tile_cleared[tile] = 0;
+	}
+	template<typename T>
+	inline std::vector<T> resource<T>::linearize()
+	{
+		// Переупаковка тайлов в построчный (row-major) порядок, например для сохранения в файл
+		if (!tile_size)
+			return data;
+
+		std::vector<T> linear(stride * y_size);
+		const size_t tile_mask = tile_size - 1;
+		for (size_t y = 0; y < y_size; ++y) {
+			for (size_t x0 = 0; x0 < stride; x0 += tile_size) {
+				const size_t run = std::min(tile_size, stride - x0);
+				auto destination = linear.begin() + y * stride + x0;
+				const size_t tile = (y >> tile_shift) * tiles_x + (x0 >> tile_shift);
+				// Нетронутый после очистки тайл не материализуем, сразу пишем clear_value
+				if (tile_cleared[tile]) {
+					std::fill(destination, destination + run, clear_value);
+					continue;
+				}
+				// Строка внутри тайла лежит непрерывно
+				auto source = data.begin() + (tile << (2 * tile_shift)) + ((y & tile_mask) << tile_shift);
+				std::copy(source, source + run, destination);
+			}
+		}
+		return linear;
+	}
+	template<typename T>
 	inline size_t resource<T>::size_bytes() const
 	{
 		// TODO Lab: 1.02 Implement `cg::resource` class
@@ -95,17 +201,29 @@ namespace cg
 		return stride;
 	}
 
+	template<typename T>
+	inline size_t resource<T>::get_y_size() const
+	{
+		return y_size;
+	}
+
+	template<typename T>
+	inline size_t resource<T>::get_tile_size() const
+	{
+		return tile_size;
+	}
+
 	struct color
 	{
 		static color from_float3(const float3& in)
 		{
 			// TODO Lab: 1.02 Implement `cg::color` and `cg::unsigned_color` structs
-			return color{};
+			return color{in.x, in.y, in.z};
 		};
 		float3 to_float3() const
 		{
 			// TODO Lab: 1.02 Implement `cg::color` and `cg::unsigned_color` structs
-			return float3{};
+			return float3{r, g, b};
 		}
 		float r;
 		float g;
@@ -117,17 +235,24 @@ namespace cg
 		static unsigned_color from_color(const color& color)
 		{
 			// TODO Lab: 1.02 Implement `cg::color` and `cg::unsigned_color` structs
-			return unsigned_color{};
+			return from_float3(color.to_float3());
 		};
 		static unsigned_color from_float3(const float3& color)
 		{
 			// TODO Lab: 1.02 Implement `cg::color` and `cg::unsigned_color` structs
-			return unsigned_color{};
+			const float3 clamped = clamp(color, 0.f, 1.f) * 255.f;
+			return unsigned_color{
+					static_cast<uint8_t>(clamped.x),
+					static_cast<uint8_t>(clamped.y),
+					static_cast<uint8_t>(clamped.z)};
 		};
 		float3 to_float3() const
 		{
 			// TODO Lab: 1.02 Implement `cg::color` and `cg::unsigned_color` structs
-			return float3{};
+			return float3{
+					static_cast<float>(r),
+					static_cast<float>(g),
+					static_cast<float>(b)} / 255.f;
 		};
 		uint8_t r;
 		uint8_t g;
@@ -135,6 +260,39 @@ namespace cg
 	};
 
 
+	struct unorm16_depth
+	{
+		static unorm16_depth from_float(float depth)
+		{
+			const float clamped = std::clamp(depth, 0.f, 1.f);
+			return unorm16_depth{static_cast<uint16_t>(clamped * 65535.f + 0.5f)};
+		};
+		float to_float() const
+		{
+			return static_cast<float>(value) / 65535.f;
+		};
+		uint16_t value;
+	};
+
+	struct unorm24_depth
+	{
+		static unorm24_depth from_float(float depth)
+		{
+			const float clamped = std::clamp(depth, 0.f, 1.f);
+			// Считаем в double, чтобы не терять младшие разряды 24-битного значения
+			const uint32_t packed = static_cast<uint32_t>(static_cast<double>(clamped) * 16777215.0 + 0.5);
+			return unorm24_depth{{static_cast<uint8_t>(packed),
+								  static_cast<uint8_t>(packed >> 8),
+								  static_cast<uint8_t>(packed >> 16)}};
+		};
+		float to_float() const
+		{
+			const uint32_t packed = uint32_t(value[0]) | (uint32_t(value[1]) << 8) | (uint32_t(value[2]) << 16);
+			return static_cast<float>(static_cast<double>(packed) / 16777215.0);
+		};
+		uint8_t value[3];
+	};
+
 	struct vertex
 	{
 		// TODO Lab: 1.03 Implement `cg::vertex` struct
@@ -142,6 +300,8 @@ namespace cg
 		float3 normal;    // NORMAL
 		float2 texcoord;  // TEXCOORD0
 		float3 ambient; 
+		float3 diffuse;
+		float3 emissive;
 	};
 
 }// namespace cg
@@ -15,16 +15,41 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	auto add_options = options.add_options();
 	add_options("height", "Render target height", cxxopts::value<unsigned>()->default_value("1080"));
 	add_options("width", "Render target width", cxxopts::value<unsigned>()->default_value("1920"));
+	add_options("render_target_tile_size", "Render target tile size in pixels, 0 for row-major layout", cxxopts::value<unsigned>()->default_value("8"));
 	add_options("model_path", "Path to OBJ model", cxxopts::value<std::filesystem::path>()->default_value("models/cube.obj"));
 	add_options("camera_position", "Camera position", cxxopts::value<std::vector<float>>()->default_value("0.0,1.0,5.0"));
 	add_options("camera_theta", "Camera polar angle", cxxopts::value<float>()->default_value("0.0"));
 	add_options("camera_phi", "Camera azimuth angle", cxxopts::value<float>()->default_value("0.0"));
+	add_options("camera_position_end", "Camera position at the end of the sequence", cxxopts::value<std::vector<float>>());
+	add_options("camera_theta_end", "Camera polar angle at the end of the sequence", cxxopts::value<float>());
+	add_options("camera_phi_end", "Camera azimuth angle at the end of the sequence", cxxopts::value<float>());
+	add_options("camera_path", "Camera path of the sequence: linear or turntable", cxxopts::value<std::string>()->default_value("linear"));
+	add_options("frame_num", "Number of frames in the sequence", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("camera_angle_of_view", "Camera angle of view", cxxopts::value<float>()->default_value("60.0"));
 	add_options("camera_z_near", "Minimum expected depth", cxxopts::value<float>()->default_value("0.001"));
 	add_options("camera_z_far", "Maximum expected depth", cxxopts::value<float>()->default_value("100.0"));
+	add_options("reverse_z", "Use reverse-Z depth (near plane maps to 1)", cxxopts::value<bool>()->default_value("false"));
+	add_options("primitive_topology", "Rasterizer index topology: list, or strip/fan rebuilt from the model triangles with primitive restart", cxxopts::value<std::string>()->default_value("list"));
+	add_options("depth_format", "Rasterizer depth buffer format: float, unorm24 or unorm16", cxxopts::value<std::string>()->default_value("float"));
 	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("bvh_builder", "BVH builder: sah for faster tracing, lbvh for faster builds or sbvh with spatial splits for the fastest tracing", cxxopts::value<std::string>()->default_value("sah"));
+	add_options("bvh_treelet_optimization", "Restructure BVH treelets after the build to lower SAH cost", cxxopts::value<bool>()->default_value("false"));
+	add_options("bvh_width", "BVH node width: 2 for a binary tree or 4 for SIMD box tests", cxxopts::value<unsigned>()->default_value("4"));
+	add_options("watertight_intersection", "Use watertight ray/triangle intersection so rays never slip through shared edges", cxxopts::value<bool>()->default_value("false"));
+	add_options("packet_tracing", "Trace primary rays and their shadow rays in 8x8 packets", cxxopts::value<bool>()->default_value("true"));
+	add_options("tile_size", "Side of square image tiles distributed between threads", cxxopts::value<unsigned>()->default_value("16"));
+	add_options("adaptive_threshold", "Relative error at which a tile stops sampling; accumulation_num becomes the average budget (0 disables)", cxxopts::value<float>()->default_value("0"));
+	add_options("time_budget_ms", "Keep accumulating passes of a frame until this deadline instead of accumulation_num (0 disables)", cxxopts::value<float>()->default_value("0"));
+	add_options("sampler", "Sample sequence for pixel jitter and path decisions: sobol, r2 or blue_noise", cxxopts::value<std::string>()->default_value("sobol"));
+	add_options("light_samples", "Shadow rays per hit, each to a light chosen by power", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("russian_roulette_depth", "Path segment from which paths are terminated by Russian roulette; raytracing_depth stays the hard limit (0 disables)", cxxopts::value<unsigned>()->default_value("3"));
+	add_options("instance_grid", "Repeat the model as instances on an N x N grid sharing one bottom-level BVH", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("model_twist", "Twist the model about the vertical axis by this angle in degrees over the sequence, refitting the BVH every frame", cxxopts::value<float>()->default_value("0"));
+	add_options("bvh_rebuild_threshold", "Rebuild a refitted BVH once its SAH cost grows by this factor", cxxopts::value<float>()->default_value("1.5"));
+	add_options("bvh_cache", "Load the model BVH from a cache file next to the model, or save it there after the build", cxxopts::value<bool>()->default_value("true"));
+	add_options("bvh_split_budget", "Extra triangle references SBVH may create by spatial splits, as a fraction of the triangle count", cxxopts::value<float>()->default_value("0.3"));
 	add_options("shader_path", "Path to a shader file", cxxopts::value<std::filesystem::path>()->default_value("shaders/shaders.hlsl"));
 	add_options("h,help", "Print usage");
 
@@ -37,17 +62,99 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 
 	settings->height = result["height"].as<unsigned>();
 	settings->width = result["width"].as<unsigned>();
+	settings->render_target_tile_size = result["render_target_tile_size"].as<unsigned>();
 	settings->model_path = result["model_path"].as<std::filesystem::path>();
 	settings->camera_position = result["camera_position"].as<std::vector<float>>();
 	settings->camera_theta = result["camera_theta"].as<float>();
 	settings->camera_phi = result["camera_phi"].as<float>();
+	settings->camera_position_end = result.count("camera_position_end") ? result["camera_position_end"].as<std::vector<float>>() : settings->camera_position;
+	settings->camera_theta_end = result.count("camera_theta_end") ? result["camera_theta_end"].as<float>() : settings->camera_theta;
+	settings->camera_phi_end = result.count("camera_phi_end") ? result["camera_phi_end"].as<float>() : settings->camera_phi;
+	settings->camera_path = result["camera_path"].as<std::string>();
+	settings->frame_num = result["frame_num"].as<unsigned>();
 	settings->camera_angle_of_view = result["camera_angle_of_view"].as<float>();
 	settings->camera_z_near = result["camera_z_near"].as<float>();
 	settings->camera_z_far = result["camera_z_far"].as<float>();
+	settings->reverse_z = result["reverse_z"].as<bool>();
+	settings->primitive_topology = result["primitive_topology"].as<std::string>();
+	settings->depth_format = result["depth_format"].as<std::string>();
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->bvh_builder = result["bvh_builder"].as<std::string>();
+	settings->bvh_treelet_optimization = result["bvh_treelet_optimization"].as<bool>();
+	settings->bvh_width = result["bvh_width"].as<unsigned>();
+	settings->watertight_intersection = result["watertight_intersection"].as<bool>();
+	settings->packet_tracing = result["packet_tracing"].as<bool>();
+	settings->tile_size = result["tile_size"].as<unsigned>();
+	settings->adaptive_threshold = result["adaptive_threshold"].as<float>();
+	settings->time_budget_ms = result["time_budget_ms"].as<float>();
+	settings->sampler = result["sampler"].as<std::string>();
+	settings->light_samples = result["light_samples"].as<unsigned>();
+	settings->russian_roulette_depth = result["russian_roulette_depth"].as<unsigned>();
+	settings->instance_grid = result["instance_grid"].as<unsigned>();
+	settings->model_twist = result["model_twist"].as<float>();
+	settings->bvh_rebuild_threshold = result["bvh_rebuild_threshold"].as<float>();
+	settings->bvh_cache = result["bvh_cache"].as<bool>();
+	settings->bvh_split_budget = result["bvh_split_budget"].as<float>();
 	settings->shader_path = result["shader_path"].as<std::filesystem::path>();
 
+	if (settings->camera_path != "linear" && settings->camera_path != "turntable")
+	{
+		THROW_ERROR("Unknown camera path: " + settings->camera_path);
+	}
+	if (settings->primitive_topology != "list" && settings->primitive_topology != "strip" && settings->primitive_topology != "fan")
+	{
+		THROW_ERROR("Unknown primitive topology: " + settings->primitive_topology);
+	}
+	if (settings->depth_format != "float" && settings->depth_format != "unorm24" && settings->depth_format != "unorm16")
+	{
+		THROW_ERROR("Unknown depth format: " + settings->depth_format);
+	}
+	if (settings->bvh_builder != "sah" && settings->bvh_builder != "lbvh" && settings->bvh_builder != "sbvh")
+	{
+		THROW_ERROR("Unknown BVH builder: " + settings->bvh_builder);
+	}
+	if (settings->sampler != "sobol" && settings->sampler != "r2" && settings->sampler != "blue_noise")
+	{
+		THROW_ERROR("Unknown sampler: " + settings->sampler);
+	}
+	if (settings->light_samples == 0 || settings->light_samples > 8)
+	{
+		THROW_ERROR("Light samples should be between 1 and 8");
+	}
+	if (settings->instance_grid == 0)
+	{
+		THROW_ERROR("Instance grid should be positive");
+	}
+	if (settings->bvh_split_budget < 0.f)
+	{
+		THROW_ERROR("BVH split budget should not be negative");
+	}
+	if (settings->bvh_rebuild_threshold < 1.f)
+	{
+		THROW_ERROR("BVH rebuild threshold should be at least 1");
+	}
+	if (settings->bvh_width != 2 && settings->bvh_width != 4)
+	{
+		THROW_ERROR("BVH width should be 2 or 4");
+	}
+	if (settings->tile_size == 0)
+	{
+		THROW_ERROR("Tile size should be positive");
+	}
+	if (settings->adaptive_threshold < 0.f)
+	{
+		THROW_ERROR("Adaptive threshold should not be negative");
+	}
+	if (settings->time_budget_ms < 0.f)
+	{
+		THROW_ERROR("Time budget should not be negative");
+	}
+	if (settings->frame_num == 0)
+	{
+		THROW_ERROR("Number of frames should be positive");
+	}
+
 	return settings;
 }
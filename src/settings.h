@@ -13,20 +13,45 @@ namespace cg
 
 		unsigned height;
 		unsigned width;
+		unsigned render_target_tile_size;
 
 		std::filesystem::path model_path;
 
 		std::vector<float> camera_position;
 		float camera_theta;
 		float camera_phi;
+		std::vector<float> camera_position_end;
+		float camera_theta_end;
+		float camera_phi_end;
+		std::string camera_path;
+		unsigned frame_num;
 		float camera_angle_of_view;
 		float camera_z_near;
 		float camera_z_far;
+		bool reverse_z;
+		std::string primitive_topology;
+		std::string depth_format;
 
 		std::filesystem::path result_path;
 
 		unsigned raytracing_depth;
 		unsigned accumulation_num;
+		std::string bvh_builder;
+		bool bvh_treelet_optimization;
+		unsigned bvh_width;
+		bool watertight_intersection;
+		bool packet_tracing;
+		unsigned tile_size;
+		float adaptive_threshold;
+		float time_budget_ms;
+		std::string sampler;
+		unsigned light_samples;
+		unsigned russian_roulette_depth;
+		unsigned instance_grid;
+		float model_twist;
+		float bvh_rebuild_threshold;
+		bool bvh_cache;
+		float bvh_split_budget;
 
 		std::filesystem::path shader_path;
 	};
@@ -0,0 +1,98 @@
+#include "mapped_file.h"
+
+#include "utils/error_handler.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+using namespace cg::utils;
+
+cg::utils::mapped_file::mapped_file(const std::filesystem::path& path)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	file_handle = file;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		return;
+	mapping_handle = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping_handle)
+		return;
+	data = static_cast<const unsigned char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+	if (data)
+		size = static_cast<size_t>(file_size.QuadPart);
+#else
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return;
+	struct stat file_stat;
+	if (fstat(file, &file_stat) == 0 && file_stat.st_size > 0)
+	{
+		void* mapping = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+		if (mapping != MAP_FAILED)
+		{
+			data = static_cast<const unsigned char*>(mapping);
+			size = static_cast<size_t>(file_stat.st_size);
+		}
+	}
+	// Отображение живёт и после закрытия дескриптора
+	close(file);
+#endif
+}
+
+cg::utils::mapped_file::~mapped_file()
+{
+#ifdef _WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle)
+		CloseHandle(file_handle);
+#else
+	if (data)
+		munmap(const_cast<unsigned char*>(data), size);
+#endif
+}
+
+bool cg::utils::mapped_file::is_open() const
+{
+	return data != nullptr;
+}
+
+const unsigned char* cg::utils::mapped_file::get_data() const
+{
+	return data;
+}
+
+size_t cg::utils::mapped_file::get_size() const
+{
+	return size;
+}
+
+uint64_t cg::utils::hash_file(const std::filesystem::path& path)
+{
+	// Пустой файл не отображается, его хеш — начальное значение
+	mapped_file file(path);
+	if (!file.is_open() && (!std::filesystem::exists(path) || std::filesystem::file_size(path) > 0))
+		THROW_ERROR("Could not map file " + path.string());
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < file.get_size(); i++)
+	{
+		hash ^= file.get_data()[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
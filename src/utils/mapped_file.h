@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+
+namespace cg::utils
+{
+	// Файл, отображённый в память только для чтения: ОС подгружает страницы при первом обращении,
+	// и чтение не проходит через промежуточный буфер
+	class mapped_file
+	{
+	public:
+		// Если файла нет или он пуст, is_open() вернёт false
+		explicit mapped_file(const std::filesystem::path& path);
+		~mapped_file();
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		bool is_open() const;
+		const unsigned char* get_data() const;
+		size_t get_size() const;
+
+	private:
+		const unsigned char* data = nullptr;
+		size_t size = 0;
+#ifdef _WIN32
+		void* file_handle = nullptr;
+		void* mapping_handle = nullptr;
+#endif
+	};
+
+	// 64-битный FNV-1a от содержимого файла
+	uint64_t hash_file(const std::filesystem::path& path);
+}// namespace cg::utils
@@ -21,18 +21,33 @@ std::string view_command(const std::filesystem::path& path)
 	return "";
 }
 
-void cg::utils::save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath)
+void cg::utils::save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath, bool open_viewer)
 {
 	int width = static_cast<int>(render_target.get_stride());
-	int height = static_cast<int>(render_target.count()) / width;
+	int height = static_cast<int>(render_target.get_y_size());
+
+	// Тайловый render target переводится в построчный вид только здесь. get_data у него не вызывается:
+	// она заполнила бы нетронутые тайлы, и linearize не смог бы писать clear_value сразу в построчную копию
+	std::vector<cg::unsigned_color> linear_data;
+	const cg::unsigned_color* data = nullptr;
+	if (render_target.get_tile_size())
+	{
+		linear_data = render_target.linearize();
+		data = linear_data.data();
+	}
+	else
+		data = render_target.get_data();
 
 	int result = stbi_write_png(
-			filepath.string().c_str(), width, height, 3, render_target.get_data(),
+			filepath.string().c_str(), width, height, 3, data,
 			width * sizeof(cg::unsigned_color));
 
 	if (result != 1)
 		THROW_ERROR("Can't save the resource");
 
+	if (!open_viewer)
+		return;
+
 	auto command = view_command(filepath);
 	if (!command.empty())
 		std::system(command.c_str());
@@ -9,9 +9,9 @@
 
 using namespace cg::world;
 
-cg::world::camera::camera() : theta(0.f), phi(0.f), height(1080.f), width(1920.f),
+cg::world::camera::camera() : position(float3{0.f, 0.f, 0.f}), theta(0.f), phi(0.f), height(1080.f), width(1920.f),
 							  aspect_ratio(1920.f / 1080.f), angle_of_view(1.04719f),
-							  z_near(0.001f), z_far(100.f), position(float3{0.f, 0.f, 0.f})
+							  z_near(0.001f), z_far(100.f), reverse_z(false)
 {
 }
 
@@ -67,6 +67,11 @@ void cg::world::camera::set_z_far(float in_z_far)
 	z_far = in_z_far;
 }
 
+void cg::world::camera::set_reverse_z(bool in_reverse_z)
+{
+	reverse_z = in_reverse_z;
+}
+
 const float4x4 cg::world::camera::get_view_matrix() const
 {
 	// TODO Lab: 1.04 Implement `cg::world::camera` class
@@ -110,6 +115,15 @@ const float4x4 cg::world::camera::get_projection_matrix() const
 	// TODO Lab: 1.04 Implement `cg::world::camera` class
 	// Праворукая перспектива с NDC z в [-1,1]
 	const float f = 1.f / tanf(angle_of_view * 0.5f);
+	if (reverse_z) {
+		// Reverse-Z: глубина 1 на ближней плоскости и 0 на дальней, точность float распределяется равномернее
+		return float4x4{
+			{ f / aspect_ratio, 0.f, 0.f,  0.f },
+			{ 0.f,               f,   0.f,  0.f },
+			{ 0.f,               0.f,  z_near / (z_far - z_near), -1.f },
+			{ 0.f,               0.f, (z_far * z_near) / (z_far - z_near), 0.f }
+		};
+	}
 	return float4x4{
 		{ f / aspect_ratio, 0.f, 0.f,  0.f },
 		{ 0.f,               f,   0.f,  0.f },
@@ -25,6 +25,7 @@ namespace cg::world
 		void set_width(float in_width);
 		void set_z_near(float in_z_near);
 		void set_z_far(float in_z_far);
+		void set_reverse_z(bool in_reverse_z);
 
 		const float4x4 get_view_matrix() const;
 		const float4x4 get_projection_matrix() const;
@@ -52,5 +53,6 @@ namespace cg::world
 		float angle_of_view;
 		float z_near;
 		float z_far;
+		bool reverse_z;
 	};
 }// namespace cg::world
\ No newline at end of file
@@ -143,6 +143,11 @@ void model::fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib
 	} else {
 		vertex.texcoord = float2{ 0.f, 0.f };
 	}
+
+	// Цвета материала
+	vertex.ambient = float3{ material.ambient[0], material.ambient[1], material.ambient[2] };
+	vertex.diffuse = float3{ material.diffuse[0], material.diffuse[1], material.diffuse[2] };
+	vertex.emissive = float3{ material.emission[0], material.emission[1], material.emission[2] };
 }
 
 